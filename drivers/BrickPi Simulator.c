@@ -0,0 +1,983 @@
+/*
+*  You may use this code as you wish, provided you give credit where it's due.
+*
+*  This is a simulator of the BrickPi FW (BrickPiFW_Compressed_Communication), for testing and benchmarking the drivers without a BrickPi.
+*
+*  It opens a pseudo-terminal, and emulates the BrickPi uCs on the other end of it. The messages are handled the same way the FW handles them
+*  (MSG_TYPE_CHANGE_ADDR, MSG_TYPE_SENSOR_TYPE, MSG_TYPE_VALUES, MSG_TYPE_E_STOP, MSG_TYPE_TIMEOUT_SETTINGS, MSG_TYPE_BAUD_SETTINGS,
+*  MSG_TYPE_VALUES_ALL, MSG_TYPE_MOTOR_SETTINGS, MSG_TYPE_SENSOR_HASH and MSG_TYPE_STATS). Bytes are timed as they would be on a real UART at the baud rate each uC is set to, and the FW's
+*  processing time is added before each reply (the FW finds the end of a message from BYTE_COUNT, so it doesn't wait for the line to go
+*  quiet). The motors drive the encoders, the
+*  communication timeout floats the motors, the FW position regulation runs every 1024 uS like Timer 0 compare A, and the sensors return simple changing values.
+*  The sensor setup is kept for as long as the simulator runs, like the FW keeps it in its EEPROM.
+*
+*  The simulator doesn't check that the host is using the same baud rate as the uC, because a pseudo-terminal can't garble the bytes.
+*  Instead, "-r" loses some of the MSG_TYPE_VALUES replies after the message has been handled, so that the host has to retry.
+*
+*  To use it, start the simulator, and then run the program with BRICKPI_UART set to the pseudo-terminal:
+*    ./simulator -l /tmp/BrickPi &
+*    BRICKPI_UART=/tmp/BrickPi ./program
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <poll.h>
+#include <signal.h>
+#include <math.h>
+#include <time.h>
+
+// gcc -o simulator "BrickPi Simulator.c" -lrt -lm
+// ./simulator [-l link] [-n uCs] [-b baud] [-d processing uS] [-r n] [-t] [-v]
+//   -l  Also make a symlink to the pseudo-terminal, so that BRICKPI_UART doesn't change from one run to the next.
+//   -n  How many BrickPi uCs to emulate (default 2). They use addresses 1, 2, ...
+//   -b  The baud rate the uCs start at (default 9600, like the FW).
+//   -d  How long a uC takes to read its sensors for MSG_TYPE_VALUES and MSG_TYPE_VALUES_ALL, in uS (default 500).
+//   -r  Lose every n'th MSG_TYPE_VALUES and MSG_TYPE_VALUES_ALL reply of each uC (default 0, none).
+//   -t  The touch sensor on PORT_1 of every uC is pressed (required for MSG_TYPE_CHANGE_ADDR).
+//   -v  Print each message.
+
+#define BYTE_MSG_TYPE               0 // MSG_TYPE is the first byte.
+  #define MSG_TYPE_CHANGE_ADDR      1 // Change the UART address.
+  #define MSG_TYPE_SENSOR_TYPE      2 // Change/set the sensor type.
+  #define MSG_TYPE_VALUES           3 // Set the motor speed and direction, and return the sesnors and encoders.
+  #define MSG_TYPE_E_STOP           4 // Float motors immidately
+  #define MSG_TYPE_TIMEOUT_SETTINGS 5 // Set the timeout
+  #define MSG_TYPE_BAUD_SETTINGS    6 // Set the baud rate
+  #define MSG_TYPE_VALUES_ALL       7 // Set the motors of every uC with one broadcast message. Each uC replies in its own time slot.
+  #define MSG_TYPE_MOTOR_SETTINGS   8 // Set the motor regulation mode and gains
+  #define MSG_TYPE_SENSOR_HASH      9 // Get the hash of the sensor setup
+  #define MSG_TYPE_STATS           10 // Get the FW's counters
+
+#define BYTE_NEW_ADDRESS     1
+#define BYTE_SENSOR_1_TYPE   1
+#define BYTE_SENSOR_2_TYPE   2
+#define BYTE_TIMEOUT         1
+#define BYTE_VALUES_SEQ      1
+#define BYTE_VALUES_BITS     2
+#define BYTE_BAUD            1
+#define BYTE_SLOT_TIME       1
+#define BYTE_SECTIONS        2
+#define BYTE_REPLY_ADDRESS   1
+#define BYTE_MOTOR_SETTINGS  1
+#define MOTOR_SETTINGS_BYTES 8
+#define BYTE_SENSOR_HASH     1
+#define BYTE_STATS_CLEAR     1
+
+#define BYTE_STATS_REPLIES        5
+#define BYTE_STATS_REPLY_SUM      9
+#define BYTE_STATS_REPLY_MAX     13
+#define BYTE_STATS_TIMEOUTS      33
+#define BYTE_STATS_REPEATS       67
+#define STATS_BYTES              69
+
+#define MASK_D0_M 0x01
+#define MASK_D0_S 0x08
+
+#define TYPE_SENSOR_LIGHT_OFF          0
+#define TYPE_SENSOR_LIGHT_ON           (MASK_D0_M | MASK_D0_S)
+#define TYPE_SENSOR_TOUCH              32
+#define TYPE_SENSOR_ULTRASONIC_CONT    33
+#define TYPE_SENSOR_ULTRASONIC_SS      34
+#define TYPE_SENSOR_RCX_LIGHT          35
+#define TYPE_SENSOR_COLOR_FULL         36
+#define TYPE_SENSOR_COLOR_RED          37
+#define TYPE_SENSOR_COLOR_GREEN        38
+#define TYPE_SENSOR_COLOR_BLUE         39
+#define TYPE_SENSOR_COLOR_NONE         40
+#define TYPE_SENSOR_I2C                41
+#define TYPE_SENSOR_I2C_9V             42
+
+#define SENSOR_OVERSAMPLE_MAX          6
+
+#define BIT_I2C_SAME 0x02
+
+#define PORT_A 0
+#define PORT_B 1
+#define PORT_1 0
+#define PORT_2 1
+
+#define MOTOR_REG_NONE          0
+#define MOTOR_REG_POSITION      1
+#define MOTOR_REG_SPEED         2
+#define MOTOR_CONTROL_REGULATED 0x002
+
+#define SIM_MAX_UCS      8
+#define SIM_RX_MAX       64           // The size of the Arduino Serial receive buffer. Longer messages are lost.
+#define SIM_TX_MAX       4096
+#define SIM_MSG_TYPES    11
+#define SIM_REG_US       1024         // The period of the FW regulation (Timer 0 compare A)
+#define SIM_REG_D_SAMPLES 8
+#define SIM_REG_ERROR_MAX 8191
+
+#define MOTOR_MAX_SPEED  2000.0       // Encoder ticks per second at full power
+#define MOTOR_TAU_DRIVE  0.05         // Time constant of the motor speed, in seconds, when driven
+#define MOTOR_TAU_FLOAT  0.3          //   ''                                            when floating
+
+// The state of one emulated BrickPi uC
+struct SimUC{
+  unsigned char Addr;
+  unsigned long Baud;
+  unsigned long Timeout;                        // COMM_TIMEOUT, in ms
+  unsigned long long LastUpdate;                // uS
+
+  unsigned char SensorType     [2];
+  unsigned char SensorSettings [2][8];
+  unsigned char Oversample     [2];             // For raw analog types, (n / 2) more bits than 10. 0 for the other types.
+  unsigned char SensorConfigured;               // If MSG_TYPE_SENSOR_TYPE has been received
+  unsigned int  SensorHash;                     // Its hash
+  unsigned char I2C_Speed      [2];
+  unsigned char I2C_Devices    [2];
+  unsigned char I2C_Out_Bytes  [2][8];
+  unsigned char I2C_In_Bytes   [2][8];
+  unsigned char I2C_Out_Array  [2][8][16];
+
+  int           Power          [2];             // -255 to 255. 0 is float.
+  double        Speed          [2];             // Encoder ticks per second
+  double        Enc            [2];
+  unsigned long long MotorTime;                 // How far the motors have been simulated, in uS
+
+  unsigned char RegMode        [2];             // The FW regulation, the same as BrickPiM
+  unsigned char RegActive      [2];
+  long          RegTarget      [2];
+  unsigned int  RegKP          [2];
+  unsigned int  RegKI          [2];
+  unsigned int  RegKD          [2];
+  unsigned char RegDead        [2];
+  long          RegIntegral    [2];
+  long          RegIntegralMax [2];
+  long          RegHistory     [2][SIM_REG_D_SAMPLES];
+  unsigned char RegHistoryIndex[2];
+  long          RegSetpoint    [2];
+  long          RegFraction    [2];
+  unsigned long long RegTime;                   // When the regulation next runs, in uS
+  unsigned long long StartTime;                 // When the uC "started", for its micros()
+
+  unsigned long StatReplies;                    // MSG_TYPE_STATS counters. There's no loop() or encoder ISR to count, and the
+  unsigned long StatReplySum;                   // pseudo-terminal doesn't garble messages, so only these are kept.
+  unsigned long StatReplyMax;
+  unsigned int  StatTimeouts;
+  unsigned int  StatRepeats;
+
+  unsigned char ValuesSeq;                      // The last MSG_TYPE_VALUES sequence number (0 when there isn't one), and the reply
+  unsigned char ValuesReply[256];               // from the sequence number on
+  unsigned char ValuesReplyBytes;
+  unsigned long ValuesReplies;                  // For "-r"
+};
+
+struct SimUC UC[SIM_MAX_UCS];
+int UCs = 2;
+
+int Master = -1;
+unsigned long ProcessUs = 500;
+unsigned long LoseEvery = 0;
+int TouchPressed = 0;
+int Verbose = 0;
+
+unsigned char RxBuf[1024];
+unsigned int  RxBytes = 0;
+unsigned long long RxStart;                     // When the first byte in RxBuf was received
+
+unsigned char TxByte[SIM_TX_MAX];               // Bytes waiting to be "transmitted", and when each one is finished
+unsigned long long TxDue[SIM_TX_MAX];
+unsigned int  TxHead = 0;
+unsigned int  TxTail = 0;
+unsigned long long TxLineFree = 0;              // When the last queued byte is finished
+
+unsigned long MessageCount[SIM_MSG_TYPES];
+unsigned long ReplyCount = 0;
+unsigned long DroppedCount = 0;
+
+unsigned char Array[256];
+unsigned int Bit_Offset = 0;
+
+unsigned long long SimNowUs(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((unsigned long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+unsigned long ByteUs(unsigned long baud){
+  return ((10 * 1000000) / baud);
+}
+
+void AddBits(unsigned char byte_offset, unsigned char bit_offset, unsigned char bits, unsigned long value){
+  unsigned char i = 0;
+  while(i < bits){
+    if(value & 0x01){
+      Array[(byte_offset + ((bit_offset + Bit_Offset + i) / 8))] |= (0x01 << ((bit_offset + Bit_Offset + i) % 8));
+    }
+    value /= 2;
+    i++;
+  }
+  Bit_Offset += bits;
+}
+
+unsigned long GetBits(unsigned char byte_offset, unsigned char bit_offset, unsigned char bits){
+  unsigned long Result = 0;
+  char i = bits;
+  while(i){
+    Result *= 2;
+    Result |= ((Array[(byte_offset + ((bit_offset + Bit_Offset + (i - 1)) / 8))] >> ((bit_offset + Bit_Offset + (i - 1)) % 8)) & 0x01);
+    i--;
+  }
+  Bit_Offset += bits;
+  return Result;
+}
+
+unsigned char BitsNeeded(unsigned long value){
+  unsigned char i = 0;
+  while(i < 32){
+    if(!value)
+      return i;
+    value /= 2;
+    i++;
+  }
+  return 31;
+}
+
+long SimRegError(struct SimUC *uc, unsigned char port){
+  long error = (uc->RegTarget[port] - (long)floor(uc->Enc[port]));
+  if(error > SIM_REG_ERROR_MAX)
+    error = SIM_REG_ERROR_MAX;
+  if(error < -SIM_REG_ERROR_MAX)
+    error = -SIM_REG_ERROR_MAX;
+  return error;
+}
+
+// The equivalent of the FW's M_RegStart
+void SimRegStart(struct SimUC *uc, unsigned char port){
+  if(uc->RegActive[port])
+    return;
+  if(uc->RegMode[port] == MOTOR_REG_NONE){
+    uc->Power[port] = 0;
+    return;
+  }
+  long sample = ((uc->RegMode[port] == MOTOR_REG_SPEED) ? (long)floor(uc->Enc[port]) : SimRegError(uc, port));
+  unsigned char i = 0;
+  while(i < SIM_REG_D_SAMPLES){
+    uc->RegHistory[port][i] = sample;
+    i++;
+  }
+  uc->RegIntegral[port] = 0;
+  uc->RegSetpoint[port] = (long)floor(uc->Enc[port]);
+  uc->RegFraction[port] = 0;
+  uc->RegActive[port] = 1;
+}
+
+// The equivalent of the FW's M_RegulateSpeed
+long SimRegulateSpeed(struct SimUC *uc, unsigned char port){
+  long enc = (long)floor(uc->Enc[port]);
+  long delta = (enc - uc->RegHistory[port][uc->RegHistoryIndex[port]]);
+  uc->RegHistory[port][uc->RegHistoryIndex[port]] = enc;
+  uc->RegHistoryIndex[port] = ((uc->RegHistoryIndex[port] + 1) % SIM_REG_D_SAMPLES);
+
+  long fraction = (uc->RegFraction[port] + (uc->RegTarget[port] * (SIM_REG_US / 64)));
+  long ticks = (fraction / 15625);
+  fraction -= (ticks * 15625);
+  if(fraction < 0){
+    fraction += 15625;
+    ticks--;
+  }
+  uc->RegFraction[port] = fraction;
+  uc->RegSetpoint[port] += ticks;
+
+  long behind = (uc->RegSetpoint[port] - enc);
+  if(behind > uc->RegIntegralMax[port]){
+    behind = uc->RegIntegralMax[port];
+    uc->RegSetpoint[port] = (enc + behind);
+  }
+  if(behind < -uc->RegIntegralMax[port]){
+    behind = -uc->RegIntegralMax[port];
+    uc->RegSetpoint[port] = (enc + behind);
+  }
+
+  long speed = ((delta * (1000000 / 64)) / ((SIM_REG_US / 64) * SIM_REG_D_SAMPLES));
+  long error = (uc->RegTarget[port] - speed);
+  if(error > SIM_REG_ERROR_MAX)
+    error = SIM_REG_ERROR_MAX;
+  if(error < -SIM_REG_ERROR_MAX)
+    error = -SIM_REG_ERROR_MAX;
+  return ((((long)uc->RegKP[port] * error) + ((long)uc->RegKI[port] * behind)) / 256);
+}
+
+// The equivalent of the FW's M_RegulatePosition
+long SimRegulatePosition(struct SimUC *uc, unsigned char port){
+  long error = SimRegError(uc, port);
+  long last = uc->RegHistory[port][uc->RegHistoryIndex[port]];
+  uc->RegHistory[port][uc->RegHistoryIndex[port]] = error;
+  uc->RegHistoryIndex[port] = ((uc->RegHistoryIndex[port] + 1) % SIM_REG_D_SAMPLES);
+
+  if(uc->RegKI[port]){
+    uc->RegIntegral[port] += error;
+    if(uc->RegIntegral[port] > uc->RegIntegralMax[port])
+      uc->RegIntegral[port] = uc->RegIntegralMax[port];
+    if(uc->RegIntegral[port] < -uc->RegIntegralMax[port])
+      uc->RegIntegral[port] = -uc->RegIntegralMax[port];
+  }
+
+  return ((((long)uc->RegKP[port] * error) + ((long)uc->RegKI[port] * uc->RegIntegral[port]) + ((long)uc->RegKD[port] * (error - last))) / 256);
+}
+
+// The equivalent of the FW's M_Regulate
+void SimRegulate(struct SimUC *uc, unsigned char port){
+  if(!uc->RegActive[port])
+    return;
+  long speed;
+  if(uc->RegMode[port] == MOTOR_REG_SPEED)
+    speed = SimRegulateSpeed(uc, port);
+  else
+    speed = SimRegulatePosition(uc, port);
+  if(speed < uc->RegDead[port] && speed > -uc->RegDead[port])
+    speed = 0;
+  if(speed > 0)
+    speed += uc->RegDead[port];
+  else if(speed < 0)
+    speed -= uc->RegDead[port];
+  if(speed > 255)
+    speed = 255;
+  if(speed < -255)
+    speed = -255;
+  uc->Power[port] = speed;
+}
+
+// Run the motors of "uc" up to time "t", running the FW regulation every SIM_REG_US. Floats the motors if the communication timeout passes
+// first.
+void SimMotors(struct SimUC *uc, unsigned long long t){
+  while(uc->MotorTime < t){
+    unsigned long long Until = t;
+    unsigned long long TimeoutAt = (uc->LastUpdate + ((unsigned long long)uc->Timeout * 1000));
+    int Timing = (uc->Timeout && (uc->Power[PORT_A] || uc->Power[PORT_B] || uc->RegActive[PORT_A] || uc->RegActive[PORT_B]));
+    if(Timing && TimeoutAt <= uc->MotorTime){                      // Already timed out
+      uc->StatTimeouts++;
+      uc->ValuesSeq = 0;
+      uc->Power[PORT_A] = 0;
+      uc->Power[PORT_B] = 0;
+      uc->RegActive[PORT_A] = 0;
+      uc->RegActive[PORT_B] = 0;
+      continue;
+    }
+    if(Timing && TimeoutAt < Until)
+      Until = TimeoutAt;
+    if(uc->RegTime <= uc->MotorTime){
+      SimRegulate(uc, PORT_A);
+      SimRegulate(uc, PORT_B);
+      uc->RegTime += SIM_REG_US;
+      if(uc->RegTime <= uc->MotorTime)                               // Don't try to catch up after the simulator was stopped
+        uc->RegTime = (uc->MotorTime + SIM_REG_US);
+    }
+    if(uc->RegTime < Until)
+      Until = uc->RegTime;
+
+    double dt = ((Until - uc->MotorTime) / 1000000.0);
+    unsigned char port = 0;
+    while(port < 2){
+      double Target = ((uc->Power[port] * MOTOR_MAX_SPEED) / 255);
+      double Tau = (uc->Power[port] ? MOTOR_TAU_DRIVE : MOTOR_TAU_FLOAT);
+      double Decay = exp(-dt / Tau);
+      uc->Enc[port] += ((Target * dt) + ((uc->Speed[port] - Target) * Tau * (1 - Decay)));
+      uc->Speed[port] = (Target + ((uc->Speed[port] - Target) * Decay));
+      port++;
+    }
+    uc->MotorTime = Until;
+  }
+}
+
+// Queue a reply from "uc" to be sent, starting no sooner than time "t"
+void SimReply(struct SimUC *uc, unsigned char ByteCount, unsigned char *OutArray, unsigned long long t){
+  unsigned char Frame[258];
+  unsigned char CheckSum = ByteCount;
+  unsigned int i = 0;
+  while(i < ByteCount){
+    CheckSum += OutArray[i];
+    Frame[i + 2] = OutArray[i];
+    i++;
+  }
+  Frame[0] = CheckSum;
+  Frame[1] = ByteCount;
+
+  if(TxHead == TxTail){
+    TxHead = 0;
+    TxTail = 0;
+  }
+  if((TxTail + ByteCount + 2) > SIM_TX_MAX)
+    return;
+  if(t < TxLineFree)
+    t = TxLineFree;
+  i = 0;
+  while(i < (unsigned int)(ByteCount + 2)){
+    t += ByteUs(uc->Baud);
+    TxByte[TxTail] = Frame[i];
+    TxDue[TxTail] = t;
+    TxTail++;
+    i++;
+  }
+  TxLineFree = t;
+  ReplyCount++;
+}
+
+// Write every queued byte that is due by now
+void SimTransmit(){
+  unsigned long long Now = SimNowUs();
+  unsigned int Due = TxHead;
+  while(Due < TxTail && TxDue[Due] <= Now)
+    Due++;
+  if(Due > TxHead){
+    int result = write(Master, &TxByte[TxHead], (Due - TxHead));
+    if(result > 0)
+      TxHead += result;
+  }
+}
+
+// The equivalent of the FW's SampleSensor. The values change slowly, so that a program can see them change.
+long SimSensor(struct SimUC *uc, unsigned char port, unsigned long long t){
+  long Wave = ((t / 10000) % 200);           // 0 - 199, repeating every 2 seconds
+  if(Wave > 99)
+    Wave = (199 - Wave);
+  switch(uc->SensorType[port]){
+    case TYPE_SENSOR_TOUCH:
+      return ((TouchPressed && port == PORT_1) ? 1 : 0);
+    case TYPE_SENSOR_ULTRASONIC_CONT:
+    case TYPE_SENSOR_ULTRASONIC_SS:
+      return (20 + Wave);
+    case TYPE_SENSOR_COLOR_FULL:
+      return (1 + ((t / 1000000) % 6));       // BLACK - WHITE, changing every second
+    case TYPE_SENSOR_I2C:
+    case TYPE_SENSOR_I2C_9V:
+      return ((1 << uc->I2C_Devices[port]) - 1);   // Every transfer succeeded
+    default:
+      return ((300 + (port * 200) + (Wave * 3)) << (uc->Oversample[port] / 2));
+  }
+}
+
+// The equivalent of the FW's SensorConfigHash (CRC-16-CCITT)
+unsigned int SimSensorHash(unsigned char *Config, unsigned char Length){
+  unsigned int Crc = 0xFFFF;
+  unsigned char i = 0;
+  while(i < Length){
+    Crc ^= (Config[i] << 8);
+    unsigned char bit = 0;
+    while(bit < 8){
+      if(Crc & 0x8000) Crc = (((Crc << 1) ^ 0x1021) & 0xFFFF);
+      else             Crc = ((Crc << 1) & 0xFFFF);
+      bit++;
+    }
+    i++;
+  }
+  return Crc;
+}
+
+// The equivalent of the FW's ParseSensorSettings
+void SimParseSensorSettings(struct SimUC *uc){
+  uc->SensorType[PORT_1] = Array[BYTE_SENSOR_1_TYPE];
+  uc->SensorType[PORT_2] = Array[BYTE_SENSOR_2_TYPE];
+  Bit_Offset = 0;
+  unsigned char port = 0;
+  while(port < 2){
+    uc->Oversample[port] = 0;
+    if(uc->SensorType[port] < TYPE_SENSOR_TOUCH){
+      uc->Oversample[port] = GetBits(3, 0, 3);
+      if(uc->Oversample[port] > SENSOR_OVERSAMPLE_MAX)
+        uc->Oversample[port] = SENSOR_OVERSAMPLE_MAX;
+    }
+    else if(uc->SensorType[port] == TYPE_SENSOR_I2C
+    || uc->SensorType[port] == TYPE_SENSOR_I2C_9V){
+      uc->I2C_Speed[port] = GetBits(3, 0, 8);
+      uc->I2C_Devices[port] = (GetBits(3, 0, 3) + 1);
+      unsigned char device = 0;
+      while(device < uc->I2C_Devices[port]){
+        GetBits(3, 0, 7);                                            // Address
+        uc->SensorSettings[port][device] = GetBits(3, 0, 2);
+        if(uc->SensorSettings[port][device] & BIT_I2C_SAME){
+          uc->I2C_Out_Bytes[port][device] = GetBits(3, 0, 4);
+          uc->I2C_In_Bytes[port][device] = GetBits(3, 0, 4);
+          unsigned char out_byte = 0;
+          while(out_byte < uc->I2C_Out_Bytes[port][device]){
+            uc->I2C_Out_Array[port][device][out_byte] = GetBits(3, 0, 8);
+            out_byte++;
+          }
+        }
+        device++;
+      }
+    }
+    port++;
+  }
+}
+
+// The equivalent of the FW's ParseHandleValues, with the bits starting at Array[byte_offset]
+void SimParseValues(struct SimUC *uc, unsigned char byte_offset){
+  Bit_Offset = 0;
+  unsigned char port = 0;
+  while(port < 2){
+    if(GetBits(byte_offset, 0, 1)){
+      long Offset = GetBits(byte_offset, 0, (GetBits(byte_offset, 0, 5) + 1));
+      if(Offset & 0x01)
+        Offset *= (-1);
+      uc->Enc[port] -= (Offset / 2);
+    }
+    port++;
+  }
+
+  port = 0;
+  while(port < 2){
+    unsigned int control = GetBits(byte_offset, 0, 10);             // 8 bits of PWM, 1 bit dir, 1 bit enable
+    if(control == MOTOR_CONTROL_REGULATED){
+      if(GetBits(byte_offset, 0, 1)){
+        long Target = GetBits(byte_offset, 0, (GetBits(byte_offset, 0, 5) + 1));
+        if(Target & 0x01)
+          Target = -(Target / 2);
+        else
+          Target /= 2;
+        uc->RegTarget[port] = Target;
+      }
+      SimRegStart(uc, port);
+      port++;
+      continue;
+    }
+    uc->RegActive[port] = 0;
+    uc->Power[port] = 0;
+    if(control & 0x01){
+      uc->Power[port] = ((control >> 2) & 0xFF);
+      if(control & 0x02)
+        uc->Power[port] *= (-1);
+    }
+    port++;
+  }
+
+  port = 0;
+  while(port < 2){
+    if(uc->SensorType[port] == TYPE_SENSOR_I2C
+    || uc->SensorType[port] == TYPE_SENSOR_I2C_9V){
+      unsigned char device = 0;
+      while(device < uc->I2C_Devices[port]){
+        if(!(uc->SensorSettings[port][device] & BIT_I2C_SAME)){
+          uc->I2C_Out_Bytes[port][device] = GetBits(byte_offset, 0, 4);
+          uc->I2C_In_Bytes [port][device] = GetBits(byte_offset, 0, 4);
+          unsigned char ii = 0;
+          while(ii < uc->I2C_Out_Bytes[port][device]){
+            uc->I2C_Out_Array[port][device][ii] = GetBits(byte_offset, 0, 8);
+            ii++;
+          }
+        }
+        device++;
+      }
+    }
+    port++;
+  }
+}
+
+// The equivalent of the FW's EncodeValues, with the bits starting at Array[byte_offset]. Returns how many bytes the bits take.
+unsigned char SimEncodeValues(struct SimUC *uc, unsigned char byte_offset, unsigned long long t){
+  long Values[2];
+  unsigned char Dir[2] = {0, 0};
+  unsigned char Bits[2] = {0, 0};
+  memset(&Array[byte_offset], 0, (256 - byte_offset));
+  Bit_Offset = 0;
+
+  unsigned char port = 0;
+  while(port < 2){
+    Values[port] = (long)uc->Enc[port];
+    if(Values[port] < 0){
+      Dir[port] = 1;
+      Values[port] *= (-1);
+    }
+    Bits[port] = BitsNeeded(Values[port]);
+    if(Bits[port])
+      Bits[port]++;
+    AddBits(byte_offset, 0, 5, Bits[port]);
+    port++;
+  }
+
+  port = 0;
+  while(port < 2){
+    Values[port] *= 2;
+    Values[port] |= Dir[port];
+    AddBits(byte_offset, 0, Bits[port], Values[port]);
+    port++;
+  }
+
+  port = 0;
+  while(port < 2){                                                   // The FW's M_Velocity. Below 1 tick per 250 mS, it reports 0.
+    long Velocity = lround(uc->Speed[port]);
+    if(labs(Velocity) < 4)
+      Velocity = 0;
+    if(Velocity > 65535)
+      Velocity = 65535;
+    if(Velocity < -65535)
+      Velocity = -65535;
+    unsigned char VelocityDir = 0;
+    if(Velocity < 0){
+      VelocityDir = 1;
+      Velocity *= (-1);
+    }
+    unsigned char VelocityBits = BitsNeeded(Velocity);
+    if(VelocityBits)
+      VelocityBits++;
+    AddBits(byte_offset, 0, 5, VelocityBits);
+    AddBits(byte_offset, 0, VelocityBits, ((Velocity * 2) | VelocityDir));
+    port++;
+  }
+
+  AddBits(byte_offset, 0, 32, (unsigned long)((t - uc->StartTime) & 0xFFFFFFFF));   // The uC's micros() when the encoders were sampled
+
+  port = 0;
+  while(port < 2){
+    long SEN = SimSensor(uc, port, t);
+    switch(uc->SensorType[port]){
+      case TYPE_SENSOR_TOUCH:
+        AddBits(byte_offset, 0, 1, SEN);
+      break;
+      case TYPE_SENSOR_ULTRASONIC_CONT:
+      case TYPE_SENSOR_ULTRASONIC_SS:
+        AddBits(byte_offset, 0, 8, SEN);
+      break;
+      case TYPE_SENSOR_COLOR_FULL:
+        AddBits(byte_offset, 0, 3, SEN);
+        AddBits(byte_offset, 0, 10, 100);                            // Blank
+        AddBits(byte_offset, 0, 10, (SEN * 100));                    // Red
+        AddBits(byte_offset, 0, 10, (SEN * 90));                     // Green
+        AddBits(byte_offset, 0, 10, (SEN * 80));                     // Blue
+      break;
+      case TYPE_SENSOR_I2C:
+      case TYPE_SENSOR_I2C_9V:
+        AddBits(byte_offset, 0, uc->I2C_Devices[port], SEN);
+        unsigned char device = 0;
+        while(device < uc->I2C_Devices[port]){
+          unsigned char in_byte = 0;
+          while(in_byte < uc->I2C_In_Bytes[port][device]){
+            AddBits(byte_offset, 0, 8, (device + in_byte));          // Just something recognisable
+            in_byte++;
+          }
+          device++;
+        }
+      break;
+      default:
+        AddBits(byte_offset, 0, (10 + (uc->Oversample[port] / 2)), SEN);
+    }
+    port++;
+  }
+
+  return ((Bit_Offset + 7) / 8);
+}
+
+// Put "bytes" bytes of "value" into "Array", low byte first
+void SimStatsPut(unsigned char byte_offset, unsigned long value, unsigned char bytes){
+  unsigned char i = 0;
+  while(i < bytes){
+    Array[byte_offset + i] = (value & 0xFF);
+    value >>= 8;
+    i++;
+  }
+}
+
+// The equivalent of the FW's HandleValues. The message's sequence number is at Array[byte_offset], followed by its bits, and the reply's
+// sequence number and bits are put at Array[reply_offset]. Returns how many bytes those take, and sets "Ready" to when the reply is ready.
+unsigned char SimHandleValues(struct SimUC *uc, unsigned char byte_offset, unsigned char reply_offset, unsigned long long t, unsigned long long *Ready){
+  unsigned char Seq = Array[byte_offset];
+  if(Seq && Seq == uc->ValuesSeq){                                   // A retry, so just the same reply again
+    uc->StatRepeats++;
+    memcpy(&Array[reply_offset], uc->ValuesReply, uc->ValuesReplyBytes);
+    *Ready = (t + 50);
+    return uc->ValuesReplyBytes;
+  }
+  SimParseValues(uc, (byte_offset + 1));
+  *Ready = (t + ProcessUs);
+  SimMotors(uc, *Ready);
+  uc->ValuesReplyBytes = (SimEncodeValues(uc, (reply_offset + 1), *Ready) + 1);
+  Array[reply_offset] = Seq;
+  uc->ValuesSeq = Seq;
+  memcpy(uc->ValuesReply, &Array[reply_offset], uc->ValuesReplyBytes);
+  return uc->ValuesReplyBytes;
+}
+
+// If "-r" loses this MSG_TYPE_VALUES or MSG_TYPE_VALUES_ALL reply of "uc"
+int SimLoseReply(struct SimUC *uc){
+  uc->ValuesReplies++;
+  return (LoseEvery && (uc->ValuesReplies % LoseEvery) == 0);
+}
+
+// Handle a message that was addressed to "uc" (Result 1), or broadcast (Result 0). "t" is when the FW would have finished receiving it.
+void SimHandle(struct SimUC *uc, int Result, unsigned char Bytes, unsigned long long t){
+  unsigned long long Ready = (t + 50);                               // Most messages take very little processing
+  unsigned char MsgType = Array[BYTE_MSG_TYPE];
+
+  SimMotors(uc, t);
+  uc->LastUpdate = t;
+  if(MsgType != MSG_TYPE_VALUES && MsgType != MSG_TYPE_VALUES_ALL)
+    uc->ValuesSeq = 0;                                               // Anything else starts a new sequence
+
+  if(MsgType == MSG_TYPE_E_STOP){
+    uc->Power[PORT_A] = 0;
+    uc->Power[PORT_B] = 0;
+    uc->RegActive[PORT_A] = 0;
+    uc->RegActive[PORT_B] = 0;
+    if(Result == 1){
+      Array[0] = MSG_TYPE_E_STOP;
+      SimReply(uc, 1, Array, Ready);
+    }
+  }
+  else if(MsgType == MSG_TYPE_CHANGE_ADDR && Bytes == 2){
+    if(TouchPressed && Array[BYTE_NEW_ADDRESS] != 0 && Array[BYTE_NEW_ADDRESS] != 255){
+      uc->Addr = Array[BYTE_NEW_ADDRESS];
+      Array[0] = MSG_TYPE_CHANGE_ADDR;
+      SimReply(uc, 1, Array, Ready);
+    }
+  }
+  else if(MsgType == MSG_TYPE_BAUD_SETTINGS && Bytes == 4){
+    uc->Baud = (Array[BYTE_BAUD] + (Array[BYTE_BAUD + 1] * 256) + (Array[BYTE_BAUD + 2] * 65536));
+    if(uc->Baud == 0)
+      uc->Baud = 9600;
+    if(Result == 1){
+      Array[0] = MSG_TYPE_BAUD_SETTINGS;
+      SimReply(uc, 1, Array, Ready);
+    }
+  }
+  else if(MsgType == MSG_TYPE_VALUES_ALL && Result == 0){
+    unsigned char Slot = 0;
+    unsigned int Section = BYTE_SECTIONS;
+    while((Section + 2) <= Bytes && Array[Section] != uc->Addr){
+      Section += (2 + Array[Section + 1]);
+      Slot++;
+    }
+    if((Section + 2) > Bytes || (Section + 2 + Array[Section + 1]) > Bytes || Array[Section + 1] < 1)   // Not included in this message
+      return;
+    unsigned long long SlotStart = (t + ((unsigned long long)Slot * Array[BYTE_SLOT_TIME] * 100));
+
+    unsigned char Reply[256];
+    unsigned char ReplyBytes = (SimHandleValues(uc, (Section + 2), (BYTE_REPLY_ADDRESS + 1), t, &Ready) + BYTE_REPLY_ADDRESS + 1);
+    Array[0] = MSG_TYPE_VALUES_ALL;
+    Array[BYTE_REPLY_ADDRESS] = uc->Addr;
+    memcpy(Reply, Array, ReplyBytes);
+    if(!SimLoseReply(uc))
+      SimReply(uc, ReplyBytes, Reply, ((SlotStart > Ready) ? SlotStart : Ready));
+  }
+  else if(Result == 1){
+    if(MsgType == MSG_TYPE_SENSOR_TYPE){
+      uc->SensorHash = SimSensorHash(&Array[1], (Bytes - 1));
+      uc->SensorConfigured = 1;
+      SimParseSensorSettings(uc);
+      Array[0] = MSG_TYPE_SENSOR_TYPE;
+      Ready = (t + 10000);                                           // Setting up the sensors takes a while
+      SimReply(uc, 1, Array, Ready);
+    }
+    else if(MsgType == MSG_TYPE_VALUES && Bytes >= BYTE_VALUES_BITS){
+      unsigned char Reply[256];
+      unsigned char ReplyBytes = (SimHandleValues(uc, BYTE_VALUES_SEQ, BYTE_VALUES_SEQ, t, &Ready) + BYTE_VALUES_SEQ);
+      Array[0] = MSG_TYPE_VALUES;
+      memcpy(Reply, Array, ReplyBytes);
+      if(!SimLoseReply(uc))
+        SimReply(uc, ReplyBytes, Reply, Ready);
+    }
+    else if(MsgType == MSG_TYPE_TIMEOUT_SETTINGS){
+      uc->Timeout = Array[BYTE_TIMEOUT] + (Array[(BYTE_TIMEOUT + 1)] * 256) + (Array[(BYTE_TIMEOUT + 2)] * 65536) + (Array[(BYTE_TIMEOUT + 3)] * 16777216);
+      Array[0] = MSG_TYPE_TIMEOUT_SETTINGS;
+      SimReply(uc, 1, Array, Ready);
+    }
+    else if(MsgType == MSG_TYPE_MOTOR_SETTINGS && Bytes == (1 + (2 * MOTOR_SETTINGS_BYTES))){
+      unsigned char port = 0;
+      while(port < 2){
+        unsigned char *Settings = &Array[(BYTE_MOTOR_SETTINGS + (port * MOTOR_SETTINGS_BYTES))];
+        uc->RegActive[port] = 0;
+        uc->RegMode[port] = Settings[0];
+        uc->RegKP[port] = (Settings[1] | (Settings[2] << 8));
+        uc->RegKI[port] = (Settings[3] | (Settings[4] << 8));
+        uc->RegKD[port] = (Settings[5] | (Settings[6] << 8));
+        uc->RegDead[port] = Settings[7];
+        uc->RegIntegralMax[port] = (uc->RegKI[port] ? (65280 / uc->RegKI[port]) : 0);
+        if(uc->RegMode[port] == MOTOR_REG_NONE)
+          uc->Power[port] = 0;
+        port++;
+      }
+      Array[0] = MSG_TYPE_MOTOR_SETTINGS;
+      SimReply(uc, 1, Array, Ready);
+    }
+    else if(MsgType == MSG_TYPE_SENSOR_HASH){
+      Array[0] = MSG_TYPE_SENSOR_HASH;
+      if(uc->SensorConfigured){
+        Array[BYTE_SENSOR_HASH]     = (uc->SensorHash & 0xFF);
+        Array[BYTE_SENSOR_HASH + 1] = (uc->SensorHash >> 8);
+        SimReply(uc, 3, Array, Ready);
+      }
+      else{
+        SimReply(uc, 1, Array, Ready);
+      }
+    }
+    else if(MsgType == MSG_TYPE_STATS){
+      unsigned char Clear = (Bytes == 2 && Array[BYTE_STATS_CLEAR] == 1);
+      memset(Array, 0, STATS_BYTES);
+      Array[0] = MSG_TYPE_STATS;
+      SimStatsPut(BYTE_STATS_REPLIES,   uc->StatReplies,  4);
+      SimStatsPut(BYTE_STATS_REPLY_SUM, uc->StatReplySum, 4);
+      SimStatsPut(BYTE_STATS_REPLY_MAX, uc->StatReplyMax, 4);
+      SimStatsPut(BYTE_STATS_TIMEOUTS,  uc->StatTimeouts, 2);
+      SimStatsPut(BYTE_STATS_REPEATS,   uc->StatRepeats,  2);
+      SimReply(uc, STATS_BYTES, Array, Ready);
+      if(Clear){
+        uc->StatReplies = 0;
+        uc->StatReplySum = 0;
+        uc->StatReplyMax = 0;
+        uc->StatTimeouts = 0;
+        uc->StatRepeats = 0;
+      }
+    }
+    uc->StatReplies++;
+    uc->StatReplySum += (Ready - t);
+    if((Ready - t) > uc->StatReplyMax)
+      uc->StatReplyMax = (Ready - t);
+  }
+}
+
+// Handle the complete message at the start of RxBuf, for each uC that it's addressed to
+void SimMessage(unsigned int FrameBytes){
+  unsigned char Dest = RxBuf[0];
+  unsigned char Bytes = RxBuf[2];
+  unsigned char CheckSum = (Dest + Bytes);
+  unsigned int i = 0;
+  while(i < Bytes){
+    CheckSum += RxBuf[i + 3];
+    i++;
+  }
+  if(FrameBytes > SIM_RX_MAX || CheckSum != RxBuf[1] || Bytes == 0){
+    DroppedCount++;
+    if(Verbose)
+      printf("Dropped a message to %d (%d bytes)\n", Dest, FrameBytes);
+    return;
+  }
+  if(RxBuf[3] < SIM_MSG_TYPES)
+    MessageCount[RxBuf[3]]++;
+  if(Verbose)
+    printf("Message type %d to %d (%d bytes)\n", RxBuf[3], Dest, FrameBytes);
+
+  i = 0;
+  while(i < (unsigned int)UCs){
+    if(Dest == 0 || Dest == UC[i].Addr){
+      unsigned long long t = (RxStart + (FrameBytes * ByteUs(UC[i].Baud)));   // When the last byte was in
+      memset(Array, 0, sizeof(Array));
+      memcpy(Array, &RxBuf[3], Bytes);
+      SimHandle(&UC[i], (Dest ? 1 : 0), Bytes, t);
+    }
+    i++;
+  }
+}
+
+void SimExit(int sig){
+  (void)sig;
+  printf("\nMessages received:");
+  unsigned char i = 1;
+  while(i < SIM_MSG_TYPES){
+    printf(" type %d: %lu", i, MessageCount[i]);
+    i++;
+  }
+  printf("\nReplies sent: %lu  Messages dropped: %lu\n", ReplyCount, DroppedCount);
+  exit(0);
+}
+
+int main(int argc, char *argv[]){
+  char *Link = NULL;
+  unsigned long Baud = 9600;
+  int opt;
+  while((opt = getopt(argc, argv, "l:n:b:d:r:tv")) != -1){
+    switch(opt){
+      case 'l': Link = optarg;                  break;
+      case 'n': UCs = atoi(optarg);             break;
+      case 'b': Baud = atol(optarg);            break;
+      case 'd': ProcessUs = atol(optarg);       break;
+      case 'r': LoseEvery = atol(optarg);       break;
+      case 't': TouchPressed = 1;               break;
+      case 'v': Verbose = 1;                    break;
+      default:
+        printf("Usage: %s [-l link] [-n uCs] [-b baud] [-d processing uS] [-r n] [-t] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+  if(UCs < 1 || UCs > SIM_MAX_UCS || Baud == 0){
+    printf("Bad arguments\n");
+    return 1;
+  }
+
+  Master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(Master == -1 || grantpt(Master) || unlockpt(Master)){
+    printf("Unable to open a pseudo-terminal\n");
+    return 1;
+  }
+  fcntl(Master, F_SETFL, O_RDWR | O_NONBLOCK);
+  struct termios options;
+  tcgetattr(Master, &options);
+  cfmakeraw(&options);
+  tcsetattr(Master, TCSANOW, &options);
+
+  if(Link){
+    unlink(Link);
+    if(symlink(ptsname(Master), Link)){
+      printf("Unable to make the link %s\n", Link);
+      return 1;
+    }
+  }
+
+  int Slave = open(ptsname(Master), O_RDWR | O_NOCTTY);    // Keep the slave open, so that the master doesn't see a hang-up between programs
+
+  unsigned long long Now = SimNowUs();
+  int i = 0;
+  while(i < UCs){
+    memset(&UC[i], 0, sizeof(struct SimUC));
+    UC[i].Addr = (i + 1);
+    UC[i].Baud = Baud;
+    UC[i].Timeout = 250;                                             // The FW's default COMM_TIMEOUT
+    UC[i].LastUpdate = Now;
+    UC[i].MotorTime = Now;
+    UC[i].RegTime = Now;
+    UC[i].StartTime = (Now - (i * 1234567));                         // Not in step with each other, like real uCs
+    i++;
+  }
+
+  signal(SIGINT , SimExit);
+  signal(SIGTERM, SimExit);
+
+  printf("BrickPi Simulator: %d uCs on %s\n", UCs, (Link ? Link : ptsname(Master)));
+  printf("Run the program with BRICKPI_UART=%s\n", (Link ? Link : ptsname(Master)));
+  fflush(stdout);
+
+  while(1){
+    struct timespec Wait;                                            // Sleep until a byte arrives, or the next queued byte is due
+    struct timespec *Timeout = NULL;
+    if(TxHead < TxTail){
+      unsigned long long Now = SimNowUs();
+      unsigned long long Us = ((TxDue[TxHead] > Now) ? (TxDue[TxHead] - Now) : 0);
+      Wait.tv_sec = (Us / 1000000);
+      Wait.tv_nsec = ((Us % 1000000) * 1000);
+      Timeout = &Wait;
+    }
+    struct pollfd fds;
+    fds.fd = Master;
+    fds.events = POLLIN;
+    fds.revents = 0;
+    ppoll(&fds, 1, Timeout, NULL);
+
+    if(fds.revents & POLLIN){
+      int result = read(Master, &RxBuf[RxBytes], (sizeof(RxBuf) - RxBytes));
+      if(result > 0){
+        if(RxBytes == 0)
+          RxStart = SimNowUs();
+        RxBytes += result;
+      }
+    }
+
+    while(RxBytes >= 3 && RxBytes >= (unsigned int)(RxBuf[2] + 3)){
+      unsigned int FrameBytes = (RxBuf[2] + 3);
+      SimMessage(FrameBytes);
+      RxBytes -= FrameBytes;
+      memmove(RxBuf, &RxBuf[FrameBytes], RxBytes);
+      RxStart = SimNowUs();
+    }
+
+    SimTransmit();
+  }
+
+  close(Slave);
+  return 0;
+}
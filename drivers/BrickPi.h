@@ -19,6 +19,7 @@
 
 #define HOST_RPI 1
 #define HOST_BBB 2
+#define HOST_SIM 3                            // The BrickPi Simulator. Selected at run time by setting BRICKPI_UART to the simulator's pseudo-terminal.
 
 #ifndef COMPILE_HOST
   #define COMPILE_HOST 0
@@ -31,6 +32,8 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <sys/select.h>
+#include <errno.h>
 #include <dirent.h>
 #include <string.h> 
 #include <stdio.h>  
@@ -73,8 +76,18 @@
 #define TYPE_MOTOR_SPEED     1    // Motor speed control
 #define TYPE_MOTOR_POSITION  2    // Motor position control
   #define MOTOR_KP_DEFAULT   2.0  // Motor position control - Proportional Konstant
+  #define MOTOR_KI_DEFAULT   0.0  // Motor position control - Integral Konstant (only used by TYPE_MOTOR_FW_POSITION)
   #define MOTOR_KD_DEFAULT   5.0  // Motor position control - Derivative Konstant
   #define MOTOR_DEAD_DEFAULT 10   // A dead-spot in the active motor control. For speeds in the range of -MOTOR_DEAD_DEFAULT to MOTOR_DEAD_DEFAULT, the motor won't run. Outside that range, the motor value is then increased (from 0) by MOTOR_DEAD_DEFAULT.
+#define TYPE_MOTOR_FW_POSITION 3  // Motor position control, regulated by the BrickPi FW at about 1 kHz. Call BrickPiSetupMotors after changing the mode or gains. Requires FW that supports MSG_TYPE_MOTOR_SETTINGS.
+#define TYPE_MOTOR_FW_SPEED  4    // Motor speed control in encoder ticks per second (MotorSpeed), regulated by the BrickPi FW. Call BrickPiSetupMotors after changing the mode or gains.
+  #define MOTOR_SPEED_KP_DEFAULT 0.1  // Motor speed control - Proportional Konstant, per tick per second of speed error
+  #define MOTOR_SPEED_KI_DEFAULT 3.0  // Motor speed control - Integral Konstant, per tick that the motor is behind
+
+#define MOTOR_REG_NONE          0     // Motor regulation modes in MSG_TYPE_MOTOR_SETTINGS
+#define MOTOR_REG_POSITION      1
+#define MOTOR_REG_SPEED         2
+#define MOTOR_CONTROL_REGULATED 0x002 // The motor control value (reverse, but not enabled) for a motor that the FW regulates
 
 #define PORT_1 0
 #define PORT_2 1
@@ -94,16 +107,51 @@
   #define MSG_TYPE_E_STOP           4 // Float motors immidately
   #define MSG_TYPE_TIMEOUT_SETTINGS 5 // Set the timeout
   #define MSG_TYPE_BAUD_SETTINGS    6 // Set the baud rate
+  #define MSG_TYPE_VALUES_ALL       7 // Broadcast the motor values for every uC. Each uC replies with its sensors and encoders in its own time slot.
+  #define MSG_TYPE_MOTOR_SETTINGS   8 // Set the motor regulation mode and gains
+  #define MSG_TYPE_SENSOR_HASH      9 // Get the hash of the sensor setup that the FW is using (restored from its EEPROM after a reset)
+  #define MSG_TYPE_STATS           10 // Get the FW's counters (loop passes, reply times, UART and I2C errors, encoder interrupts, timeouts)
 
   // New UART address (MSG_TYPE_CHANGE_ADDR)
     #define BYTE_NEW_ADDRESS     1
   
   // Sensor setup (MSG_TYPE_SENSOR_TYPE)
     #define BYTE_SENSOR_1_TYPE   1
-    #define BYTE_SENSOR_2_TYPE   2
+    #define BYTE_SENSOR_2_TYPE   2 // Then bits for each port: the I2C settings, or for a raw analog type (0 - 31) 3 bits of oversampling
   
   // Timeout setup (MSG_TYPE_TIMEOUT_SETTINGS)
     #define BYTE_TIMEOUT 1
+  
+  // Values (MSG_TYPE_VALUES), and the reply
+    #define BYTE_VALUES_SEQ      1 // Sequence number 1 - 255, echoed in the reply. A retry has the same one, so the uC only replies again.
+    #define BYTE_VALUES_BITS     2
+  
+  // Values for every uC (MSG_TYPE_VALUES_ALL)
+    #define BYTE_SLOT_TIME       1 // Width of each reply time slot, in 100 uS units
+    #define BYTE_SECTIONS        2 // For each uC: address 1 byte, byte count 1 byte, then the same sequence number and bits as MSG_TYPE_VALUES
+    #define BYTE_REPLY_ADDRESS   1 // The reply has the address of the uC, followed by the same sequence number and bits as the MSG_TYPE_VALUES reply
+  
+  // Motor regulation setup (MSG_TYPE_MOTOR_SETTINGS)
+    #define BYTE_MOTOR_SETTINGS  1 // For each motor: mode 1 byte, KP, KI and KD 2 bytes each (8.8 fixed point, low byte first), dead band 1 byte
+    #define MOTOR_SETTINGS_BYTES 8
+  
+  // Statistics (MSG_TYPE_STATS)
+    #define BYTE_STATS_CLEAR     1 // Optional. 1 to clear the counters after replying.
+  
+  // Sensor setup hash reply (MSG_TYPE_SENSOR_HASH)
+    #define BYTE_SENSOR_HASH     1 // 2 bytes, low byte first. Not included if the sensors haven't been set up.
+  
+  // Statistics reply (MSG_TYPE_STATS), all low byte first
+    #define BYTE_STATS_LOOPS          1 // 4 bytes, loop() passes
+    #define BYTE_STATS_REPLIES        5 // 4 bytes, addressed messages handled
+    #define BYTE_STATS_REPLY_SUM      9 // 4 bytes, uS from receiving them to queueing the reply, summed
+    #define BYTE_STATS_REPLY_MAX     13 // 4 bytes, uS, the longest
+    #define BYTE_STATS_UART_ERRORS   17 // 2 bytes each for UART_ReadFrame errors -3 (another uC's address), -4, -5 and -6
+    #define BYTE_STATS_ENCODER_ISR   25 // 4 bytes each for PORT_A and PORT_B
+    #define BYTE_STATS_TIMEOUTS      33 // 2 bytes, how many times the communication timeout floated the motors
+    #define BYTE_STATS_I2C_ERRORS    35 // 2 bytes each for the 8 devices on PORT_1, then PORT_2
+    #define BYTE_STATS_REPEATS       67 // 2 bytes, MSG_TYPE_VALUES retries that were answered with the last reply
+    #define STATS_BYTES              69
 
 #define TYPE_SENSOR_RAW                0 // - 31
 #define TYPE_SENSOR_LIGHT_OFF          0
@@ -120,6 +168,8 @@
 #define TYPE_SENSOR_I2C                41
 #define TYPE_SENSOR_I2C_9V             42
 
+#define SENSOR_OVERSAMPLE_MAX          6  // Up to 2^6 ADC conversions averaged, for 13 bit raw analog values
+
 #define BIT_I2C_MID  0x01  // Do one of those funny clock pulses between writing and reading. defined for each device.
 #define BIT_I2C_SAME 0x02  // The transmit data, and the number of bytes to read and write isn't going to change. defined for each device.
 
@@ -132,12 +182,27 @@
 
 int SW_HOST = 0;
 unsigned long BAUD_IDEAL = BAUD_DEFAULT;   // This will be changed, specific to the host.
+unsigned long BaudRate = BAUD_DEFAULT;     // The baud rate that the local UART is currently configured for.
+const char *BrickPiBaudCache = "/tmp/BrickPi.baud";   // Where the baud rate the BrickPi was last set to is kept, so that BrickPiConfigBaud can try it first. NULL to not keep it.
 
 int RPiRev = 0; // If the host is a RPi, this will be set to the HW revision (1 or 2).
 
+#define RX_WAIT_SPIN 0                            // Check for new bytes every 100 uS (the original method)
+#define RX_WAIT_POLL 1                            // Sleep in the kernel until bytes arrive
+
+int BrickPiRxWaitMode = RX_WAIT_POLL;
+
 int BrickPiSetLed(unsigned char led, int value);
 void BrickPiUpdateLEDs(void);
 void BrickPiTx(unsigned char dest, unsigned char ByteCount, unsigned char OutArray[]);
+void BrickPiTxFrame(unsigned char dest, unsigned char ByteCount, unsigned char OutArray[]);
+int BrickPiRx(unsigned char *InBytes, unsigned char *InArray, long timeout);
+int BrickPiRxFlush(void);
+int BrickPiRxReady(void);
+int BrickPiRxTake(unsigned char *InBytes, unsigned char *InArray);
+int BrickPiRxTimeout(void);
+int BrickPiRxWait(long timeout);
+void BrickPiUpdateRelease(unsigned char i);
 
 // BrickPi data struct
 struct BrickPiStruct{
@@ -152,19 +217,24 @@ struct BrickPiStruct{
 /*
   Motors
 */
-  int           MotorSpeed             [NUMBER_OF_BRICKPIS * 4];        // Motor speeds, from -255 to 255
+  int           MotorSpeed             [NUMBER_OF_BRICKPIS * 4];        // Motor speeds, from -255 to 255. For TYPE_MOTOR_FW_SPEED, in encoder ticks per second.
   unsigned char MotorEnable            [NUMBER_OF_BRICKPIS * 4];        // Motor mode. Float, Speed, Position.
-  long          MotorTarget            [NUMBER_OF_BRICKPIS * 4];        // Motor target position. This is implemented on the RPi, not in the BrickPi FW.
+  long          MotorTarget            [NUMBER_OF_BRICKPIS * 4];        // Motor target position. For TYPE_MOTOR_POSITION this is implemented on the RPi, and for TYPE_MOTOR_FW_POSITION in the BrickPi FW.
   long          MotorTargetLastError   [NUMBER_OF_BRICKPIS * 4];        // Value used internally for motor position regulation.
   float         MotorTargetKP          [NUMBER_OF_BRICKPIS * 4];        // Percent Konstant - used for motor position regulation.
+  float         MotorTargetKI          [NUMBER_OF_BRICKPIS * 4];        // Integral Konstant - used for motor position regulation in the FW.
   float         MotorTargetKD          [NUMBER_OF_BRICKPIS * 4];        // Derivative Konstant - used for motor position regulation.
   unsigned char MotorDead              [NUMBER_OF_BRICKPIS * 4];        // How wide of a gap to leave between 0 and the value speed value used for running to a target position.
+  float         MotorSpeedKP           [NUMBER_OF_BRICKPIS * 4];        // Percent Konstant - used for motor speed regulation in the FW.
+  float         MotorSpeedKI           [NUMBER_OF_BRICKPIS * 4];        // Integral Konstant - used for motor speed regulation in the FW.
 
 /*
   Encoders
 */
   long          EncoderOffset          [NUMBER_OF_BRICKPIS * 4];        // Encoder offsets
   long          Encoder                [NUMBER_OF_BRICKPIS * 4];        // Encoder values
+  long          EncoderVelocity        [NUMBER_OF_BRICKPIS * 4];        // Encoder ticks per second, timed by the BrickPi FW from the encoder transitions since the last update
+  unsigned long EncoderTime            [NUMBER_OF_BRICKPIS * 2];        // For each BrickPi uC, its micros() when both of its encoders were sampled. The difference between two updates is the exact time between the samples.
 
 /*
   Sensors
@@ -173,6 +243,7 @@ struct BrickPiStruct{
   long          SensorArray            [NUMBER_OF_BRICKPIS * 4][4];     // For more sensor values for the sensor (e.g. for color sensor FULL mode).
   unsigned char SensorType             [NUMBER_OF_BRICKPIS * 4];        // Sensor types
   unsigned char SensorSettings         [NUMBER_OF_BRICKPIS * 4][8];     // Sensor settings, used for specifying I2C settings.
+  unsigned char SensorOversample       [NUMBER_OF_BRICKPIS * 4];        // For raw analog sensor types (0 - 31), the FW averages 2^n ADC conversions (n 0 - 6), and Sensor has (n / 2) more bits than 10.
 
 /*
   I2C
@@ -191,44 +262,10 @@ struct BrickPiStruct BrickPi;
 unsigned char Array[256];
 unsigned char BytesReceived;
 
-// Tell the BrickPi to float all motors immidately
-int BrickPiEmergencyStop(){
-/*
-  Try 3 times to send E Stop to each of the uCs.
-  If failed:
-    Broadcast E Stop 3 times.
-*/
-  
-  unsigned char i = 0;
-  while(i < 3){
-    unsigned char ii = 0;
-    while(ii < (NUMBER_OF_BRICKPIS * 2)){
-      Array[BYTE_MSG_TYPE] = MSG_TYPE_E_STOP;
-      BrickPiTx(BrickPi.Address[ii], 1, Array);
-      if(BrickPiRx(&BytesReceived, Array, 5000)){
-        goto NEXT_TRY;
-      }
-      if(!(BytesReceived == 1 && Array[BYTE_MSG_TYPE] == MSG_TYPE_E_STOP)){
-        goto NEXT_TRY;
-      }
-      if(ii == ((NUMBER_OF_BRICKPIS * 2) - 1)){
-        return 0;
-      }
-      ii++;
-    }
-NEXT_TRY:
-    i++;
-  }
-  
-  i = 0;
-  while(i < 3){
-    Array[BYTE_MSG_TYPE] = MSG_TYPE_E_STOP;
-    BrickPiTx(0, 1, Array);
-    usleep(5000);
-    i++;
-  }
-  return -1;
-}
+volatile int  BrickPiStopped = 0;                            // Set by BrickPiEmergencyStop. While it's set, updates give up and no more are started. Clear it to carry on.
+unsigned long BrickPiStopTimeout = 20000;                    // The most uS that BrickPiEmergencyStop spends confirming the stop
+unsigned long BrickPiStopSent;                               // uS from calling BrickPiEmergencyStop until the E Stop broadcast had been sent
+unsigned long BrickPiStopLatency [NUMBER_OF_BRICKPIS * 2];   // uS from calling BrickPiEmergencyStop until each uC acknowledged the stop, or 0 if it didn't
 
 // Change the BrickPi address, for one of the uCs
 int BrickPiChangeAddress(unsigned char OldAddr, unsigned char NewAddr){
@@ -263,6 +300,17 @@ int BrickPiSetTimeout(){
   return 0;
 }
 
+// Keep the baud rate that the BrickPi is using in BrickPiBaudCache. The BrickPi FW stores it too, and starts with it after a reset.
+void BrickPiBaudCacheStore(unsigned long baud){
+  if(BrickPiBaudCache == NULL)
+    return;
+  FILE *file = fopen(BrickPiBaudCache, "w");
+  if(file == NULL)
+    return;
+  fprintf(file, "%lu\n", baud);
+  fclose(file);
+}
+
 // Tell the BrickPi to use a new baud rate
 int BrickPiSetBaud(unsigned long baud_old, unsigned long baud_new){
   unsigned char result = 0;
@@ -275,7 +323,8 @@ int BrickPiSetBaud(unsigned long baud_old, unsigned long baud_new){
     
     UART_Configure(baud_old);
     BrickPiTx(BrickPi.Address[i], 4, Array);
-    UART_Configure(baud_new);
+    if(baud_new != baud_old)          // Configuring the UART discards what has been received, which could already include the reply
+      UART_Configure(baud_new);
     
     if(BrickPiRx(&BytesReceived, Array, 5000))
       result |= (0x01 << i);
@@ -290,36 +339,50 @@ int BrickPiSetBaud(unsigned long baud_old, unsigned long baud_new){
     if(BrickPiSetTimeout() == -1){    // Try setting the timeout, which will determine if communication is successful at the desired baud rate.
       return result;                  // If setting the timeout also failed, return the error.
     }
+    BrickPiBaudCacheStore(baud_old);
+    return 0;
   }                                   
+  BrickPiBaudCacheStore(baud_new);
   return 0;                           // Else return 0 (no error).
 }
 
 unsigned int Bit_Offset = 0;
 
 // Add "bits" number of bits of "value" to "Array"
+// The bits are lined up in a 64 bit word, and ORed into "Array" a whole byte at a time.
 void AddBits(unsigned char byte_offset, unsigned char bit_offset, unsigned char bits, unsigned long value){
-  unsigned char i = 0;
-  while(i < bits){
-    if(value & 0x01){
-      Array[(byte_offset + ((bit_offset + Bit_Offset + i) / 8))] |= (0x01 << ((bit_offset + Bit_Offset + i) % 8));
-    }
-    value /= 2;
-    i++;
+  unsigned int Position = (bit_offset + Bit_Offset);
+  unsigned char *Byte = &Array[(byte_offset + (Position / 8))];
+  unsigned long long Word = value;
+  if(bits < 64)
+    Word &= ((1ULL << bits) - 1);
+  Word <<= (Position % 8);
+  while(Word){
+    *Byte |= (Word & 0xFF);
+    Word >>= 8;
+    Byte++;
   }
   Bit_Offset += bits;
 }
 
 // Extract "bits" number of bits from "Array"
+// The bytes holding the bits are read into a 64 bit word, which is then shifted and masked.
 unsigned long GetBits(unsigned char byte_offset, unsigned char bit_offset, unsigned char bits){
-  unsigned long Result = 0;
-  char i = bits;
-  while(i){
-    Result *= 2;
-    Result |= ((Array[(byte_offset + ((bit_offset + Bit_Offset + (i - 1)) / 8))] >> ((bit_offset + Bit_Offset + (i - 1)) % 8)) & 0x01);    
-    i--;
+  if(!bits)
+    return 0;
+  unsigned int Position = (bit_offset + Bit_Offset);
+  unsigned char *Byte = &Array[(byte_offset + (Position / 8))];
+  unsigned char BytesUsed = (((Position % 8) + bits + 7) / 8);
+  unsigned long long Word = 0;
+  while(BytesUsed){
+    BytesUsed--;
+    Word = ((Word << 8) | Byte[BytesUsed]);
   }
+  Word >>= (Position % 8);
+  if(bits < 64)
+    Word &= ((1ULL << bits) - 1);
   Bit_Offset += bits;
-  return Result;
+  return Word;
 }
 
 // Determine how many bits are needed to store the value
@@ -331,275 +394,1326 @@ unsigned char BitsNeeded(unsigned long value){
     value /= 2;
     i++;
   }
-  return 31;
+  return 31;
+}
+
+int BrickPiSensorHashCheck = 1;              // Set to 0 to always send the sensor setup, even if the FW already has the same one (e.g. to recalibrate the color sensor). Requires FW that supports MSG_TYPE_SENSOR_HASH to skip it.
+
+// CRC-16-CCITT of a MSG_TYPE_SENSOR_TYPE message, not including the MSG_TYPE byte. The FW calculates it the same way.
+unsigned int BrickPiSensorHash(unsigned char *Config, unsigned char Length){
+  unsigned int Crc = 0xFFFF;
+  unsigned char i = 0;
+  while(i < Length){
+    Crc ^= (Config[i] << 8);
+    unsigned char bit = 0;
+    while(bit < 8){
+      if(Crc & 0x8000) Crc = (((Crc << 1) ^ 0x1021) & 0xFFFF);
+      else             Crc = ((Crc << 1) & 0xFFFF);
+      bit++;
+    }
+    i++;
+  }
+  return Crc;
+}
+
+// Ask BrickPi uC "i" if its sensors are already set up with the setup that hashes to "Hash". Returns 1 if they are.
+int BrickPiSensorHashMatches(unsigned char i, unsigned int Hash){
+  Array[BYTE_MSG_TYPE] = MSG_TYPE_SENSOR_HASH;
+  BrickPiTx(BrickPi.Address[i], 1, Array);
+  if(BrickPiRx(&BytesReceived, Array, 5000))
+    return 0;
+  if(!(BytesReceived == 3 && Array[BYTE_MSG_TYPE] == MSG_TYPE_SENSOR_HASH))
+    return 0;
+  return ((unsigned int)(Array[BYTE_SENSOR_HASH] | (Array[BYTE_SENSOR_HASH + 1] << 8)) == Hash);
+}
+
+// Configure sensors. A BrickPi uC that already has the same setup (e.g. restored from its EEPROM after a reset) is skipped.
+int BrickPiSetupSensors(){
+  unsigned char i = 0;
+  while(i < (NUMBER_OF_BRICKPIS * 2)){
+    BrickPiUpdateRelease(i);                  // The uC won't repeat its last MSG_TYPE_VALUES reply after this, and the message layout could change
+    int ii = 0;
+    while(ii < 256){
+      Array[ii] = 0;
+      ii++;
+    }
+    Bit_Offset = 0;
+    Array[BYTE_MSG_TYPE] = MSG_TYPE_SENSOR_TYPE;
+    Array[BYTE_SENSOR_1_TYPE] = BrickPi.SensorType[PORT_1 + (i * 2)];
+    Array[BYTE_SENSOR_2_TYPE] = BrickPi.SensorType[PORT_2 + (i * 2)];
+    ii = 0;
+    while(ii < 2){
+      unsigned char port = (i * 2) + ii;
+      if(Array[BYTE_SENSOR_1_TYPE + ii] < TYPE_SENSOR_TOUCH){
+        if(BrickPi.SensorOversample[port] > SENSOR_OVERSAMPLE_MAX)
+          BrickPi.SensorOversample[port] = SENSOR_OVERSAMPLE_MAX;
+        AddBits(3, 0, 3, BrickPi.SensorOversample[port]);
+      }
+      else if(Array[BYTE_SENSOR_1_TYPE + ii] == TYPE_SENSOR_I2C
+      || Array[BYTE_SENSOR_1_TYPE + ii] == TYPE_SENSOR_I2C_9V){
+        AddBits(3, 0, 8, BrickPi.SensorI2CSpeed[port]);
+        
+        if(BrickPi.SensorI2CDevices[port] > 8)
+          BrickPi.SensorI2CDevices[port] = 8;
+        
+        if(BrickPi.SensorI2CDevices[port] == 0)
+          BrickPi.SensorI2CDevices[port] = 1;
+        
+        AddBits(3, 0, 3, (BrickPi.SensorI2CDevices[port] - 1));
+        
+        unsigned char device = 0;
+        while(device < BrickPi.SensorI2CDevices[port]){
+          AddBits(3, 0, 7, (BrickPi.SensorI2CAddr[port][device] >> 1));
+          AddBits(3, 0, 2, BrickPi.SensorSettings[port][device]);
+          if(BrickPi.SensorSettings[port][device] & BIT_I2C_SAME){          
+            AddBits(3, 0, 4, BrickPi.SensorI2CWrite[port][device]);
+            AddBits(3, 0, 4, BrickPi.SensorI2CRead [port][device]);
+            unsigned char out_byte = 0;
+            while(out_byte < BrickPi.SensorI2CWrite[port][device]){
+              AddBits(3, 0, 8, BrickPi.SensorI2COut[port][device][out_byte]);
+              out_byte++;
+            }
+          }
+          device++;
+        }
+      }
+      ii++;
+    }
+    unsigned char UART_TX_BYTES = (((Bit_Offset + 7) / 8) + 3);
+    if(BrickPiSensorHashCheck){
+      unsigned char Message[256];
+      memcpy(Message, Array, UART_TX_BYTES);
+      if(BrickPiSensorHashMatches(i, BrickPiSensorHash(&Message[1], (UART_TX_BYTES - 1)))){
+        i++;
+        continue;
+      }
+      memcpy(Array, Message, UART_TX_BYTES);
+    }
+    BrickPiTx(BrickPi.Address[i], UART_TX_BYTES, Array);
+    if(BrickPiRx(&BytesReceived, Array, 1000000))
+      return -1;
+    if(!(BytesReceived == 1 && Array[BYTE_MSG_TYPE] == MSG_TYPE_SENSOR_TYPE))
+      return -1;
+    i++;
+  }
+  return 0;
+}
+
+
+// Convert a gain to the 8.8 fixed point that MSG_TYPE_MOTOR_SETTINGS uses
+unsigned int BrickPiFixedGain(float gain){
+  return Clip((gain * 256.0) + 0.5, 0, 65535);
+}
+
+long          MotorTargetSent   [NUMBER_OF_BRICKPIS * 4];     // The last TYPE_MOTOR_FW_POSITION target that the uC received
+unsigned char MotorTargetValid  [NUMBER_OF_BRICKPIS * 4];     // MotorTargetSent is what the uC has
+long          UpdateTargets     [NUMBER_OF_BRICKPIS * 4];     // The targets that were sent in the last MSG_TYPE_VALUES message
+unsigned char UpdateTargetsSent [NUMBER_OF_BRICKPIS * 4];
+
+// Set the motor regulation mode and gains for every BrickPi uC. Motors with TYPE_MOTOR_FW_POSITION are regulated by the FW, using
+// MotorTargetKP, MotorTargetKI, MotorTargetKD and MotorDead. The FW runs the regulation about every mS, with the derivative taken
+// over 8 mS, so the gains mean about the same as they do for TYPE_MOTOR_POSITION with 10 mS updates. Motors with TYPE_MOTOR_FW_SPEED
+// use MotorSpeedKP on the speed error (measured over 8 mS), and MotorSpeedKI on how many ticks the motor is behind, with no dead band.
+int BrickPiSetupMotors(){
+  unsigned char i = 0;
+  while(i < (NUMBER_OF_BRICKPIS * 2)){
+    Array[BYTE_MSG_TYPE] = MSG_TYPE_MOTOR_SETTINGS;
+    unsigned char ii = 0;
+    while(ii < 2){
+      unsigned char port = (i * 2) + ii;
+      unsigned char *Settings = &Array[(BYTE_MOTOR_SETTINGS + (ii * MOTOR_SETTINGS_BYTES))];
+      unsigned int KP = BrickPiFixedGain(BrickPi.MotorTargetKP[port]);
+      unsigned int KI = BrickPiFixedGain(BrickPi.MotorTargetKI[port]);
+      unsigned int KD = BrickPiFixedGain(BrickPi.MotorTargetKD[port]);
+      Settings[0] = MOTOR_REG_NONE;
+      Settings[7] = BrickPi.MotorDead[port];
+      if(BrickPi.MotorEnable[port] == TYPE_MOTOR_FW_POSITION){
+        Settings[0] = MOTOR_REG_POSITION;
+      }else if(BrickPi.MotorEnable[port] == TYPE_MOTOR_FW_SPEED){
+        Settings[0] = MOTOR_REG_SPEED;
+        KP = BrickPiFixedGain(BrickPi.MotorSpeedKP[port]);
+        KI = BrickPiFixedGain(BrickPi.MotorSpeedKI[port]);
+        KD = 0;
+        Settings[7] = 0;
+      }
+      Settings[1] = (KP & 0xFF);
+      Settings[2] = (KP >> 8);
+      Settings[3] = (KI & 0xFF);
+      Settings[4] = (KI >> 8);
+      Settings[5] = (KD & 0xFF);
+      Settings[6] = (KD >> 8);
+      MotorTargetValid[port] = 0;                 // Send the target again with the next update
+      ii++;
+    }
+    BrickPiTx(BrickPi.Address[i], (1 + (2 * MOTOR_SETTINGS_BYTES)), Array);
+    if(BrickPiRx(&BytesReceived, Array, 5000))
+      return -1;
+    if(!(BytesReceived == 1 && Array[BYTE_MSG_TYPE] == MSG_TYPE_MOTOR_SETTINGS))
+      return -1;
+    i++;
+  }
+  return 0;
+}
+
+// uC "i" received the TYPE_MOTOR_FW_POSITION targets that were in the last message encoded for it
+void BrickPiTargetsSent(unsigned char i){
+  unsigned char ii = 0;
+  while(ii < 2){
+    unsigned char port = (i * 2) + ii;
+    if(UpdateTargetsSent[port]){
+      MotorTargetSent[port] = UpdateTargets[port];
+      MotorTargetValid[port] = 1;
+      UpdateTargetsSent[port] = 0;
+    }
+    ii++;
+  }
+}
+
+// Add a signed value the same way the encoder offsets are sent: length 5 bits, then the value (length + 1 bits) with the sign in bit 0
+void BrickPiAddSigned(unsigned char byte_offset, long value){
+  unsigned char Dir = 0;
+  if(value < 0){
+    Dir = 1;
+    value *= (-1);
+  }
+  unsigned char Bits = BitsNeeded(value);
+  AddBits(byte_offset, 0, 5, Bits);
+  AddBits(byte_offset, 0, (Bits + 1), ((value * 2) | Dir));
+}
+
+// Compress the motor and encoder offset values (and the I2C data, for I2C ports that aren't in BIT_I2C_SAME mode) for BrickPi uC "i", starting at Array[byte_offset].
+// Array must be cleared first. Returns how many bytes were used.
+unsigned char BrickPiEncodeValues(unsigned char i, unsigned char byte_offset){
+  unsigned int ii = 0;
+  
+  Bit_Offset = 0;
+  
+//    AddBits(byte_offset, 0, 2, 0);     use this to disable encoder offset
+  
+  ii = 0;                 // use this for encoder offset support
+  while(ii < 2){
+    unsigned char port = (i * 2) + ii;
+    if(BrickPi.EncoderOffset[port]){
+      long Temp_Value = BrickPi.EncoderOffset[port];
+      unsigned char Temp_ENC_DIR = 0;
+      unsigned char Temp_BitsNeeded = 0;
+      
+      AddBits(byte_offset, 0, 1, 1);
+      if(Temp_Value < 0){
+        Temp_ENC_DIR = 1;
+        Temp_Value *= (-1);
+      }        
+      Temp_BitsNeeded = BitsNeeded(Temp_Value);
+      AddBits(byte_offset, 0, 5, Temp_BitsNeeded);
+      Temp_BitsNeeded++;
+      Temp_Value *= 2;
+      Temp_Value |= Temp_ENC_DIR;
+      AddBits(byte_offset, 0, Temp_BitsNeeded, Temp_Value);
+    }
+    else{
+      AddBits(byte_offset, 0, 1, 0);
+    }
+    ii++;
+  }
+  
+  int speed;
+  unsigned char dir;    
+  ii = 0;
+  while(ii < 2){
+    unsigned char port = (i * 2) + ii;
+    
+    UpdateTargetsSent[port] = 0;
+    if(BrickPi.MotorEnable[port] == TYPE_MOTOR_FLOAT){
+      AddBits(byte_offset, 0, 10, 0);
+    }else if(BrickPi.MotorEnable[port] == TYPE_MOTOR_FW_POSITION || BrickPi.MotorEnable[port] == TYPE_MOTOR_FW_SPEED){
+      long target = ((BrickPi.MotorEnable[port] == TYPE_MOTOR_FW_SPEED) ? BrickPi.MotorSpeed[port] : BrickPi.MotorTarget[port]);
+      AddBits(byte_offset, 0, 10, MOTOR_CONTROL_REGULATED);
+      if(MotorTargetValid[port] && MotorTargetSent[port] == target){
+        AddBits(byte_offset, 0, 1, 0);              // The uC already has the target
+      }else{
+        AddBits(byte_offset, 0, 1, 1);
+        BrickPiAddSigned(byte_offset, target);
+        UpdateTargets[port] = target;
+        UpdateTargetsSent[port] = 1;
+      }
+    }else{
+      if(BrickPi.MotorEnable[port] == TYPE_MOTOR_SPEED){
+        speed = BrickPi.MotorSpeed[port];
+      }else if(BrickPi.MotorEnable[port] == TYPE_MOTOR_POSITION){
+        long error = BrickPi.MotorTarget[port] - BrickPi.Encoder[port];
+        float speed_f = (error * BrickPi.MotorTargetKP[port]) + ((error - BrickPi.MotorTargetLastError[port]) * BrickPi.MotorTargetKD[port]);
+        BrickPi.MotorTargetLastError[port] = error;
+        if(speed_f < BrickPi.MotorDead[port] && speed_f > -BrickPi.MotorDead[port]){
+          speed_f = 0;
+        }
+        if(speed_f > 0){
+          speed_f += BrickPi.MotorDead[port];
+        }else if(speed_f < 0){
+          speed_f -= BrickPi.MotorDead[port];
+        }
+        speed = Clip(speed_f, -255, 255); // Clip the speed to the range of -255 to 255.
+/*#ifdef DEBUG
+        printf("Speed: %d\n", speed);        
+#endif*/
+      }
+      
+      dir = 0;
+      if(speed < 0){
+        dir = 1;
+        speed *= (-1);
+      }
+      if(speed > 255){
+        speed = 255;
+      }
+      AddBits(byte_offset, 0, 10, ((((speed & 0xFF) << 2) | (dir << 1) | (0x01)) & 0x3FF));
+    }
+    ii++;
+  }
+  
+  ii = 0;
+  while(ii < 2){
+    unsigned char port = (i * 2) + ii;
+    if(BrickPi.SensorType[port] == TYPE_SENSOR_I2C
+    || BrickPi.SensorType[port] == TYPE_SENSOR_I2C_9V){
+      unsigned char device = 0;
+      while(device < BrickPi.SensorI2CDevices[port]){
+        if(!(BrickPi.SensorSettings[port][device] & BIT_I2C_SAME)){
+          AddBits(byte_offset, 0, 4, BrickPi.SensorI2CWrite[port][device]);
+          AddBits(byte_offset, 0, 4, BrickPi.SensorI2CRead [port][device]);
+          unsigned char out_byte = 0;
+          while(out_byte < BrickPi.SensorI2CWrite[port][device]){
+            AddBits(byte_offset, 0, 8, BrickPi.SensorI2COut[port][device][out_byte]);
+            out_byte++;
+          }
+        }
+        device++;
+      }
+    }
+    ii++;
+  }
+  
+  return ((Bit_Offset + 7) / 8);
+}
+
+// How many bits the FW sends for an analog sensor value. Raw analog types have (SensorOversample / 2) more bits than the ADC's 10.
+unsigned char BrickPiAnalogBits(unsigned char port){
+  if(BrickPi.SensorType[port] < TYPE_SENSOR_TOUCH)
+    return (10 + (BrickPi.SensorOversample[port] / 2));
+  return 10;
+}
+
+// Extract the encoder and sensor values for BrickPi uC "i" from a reply, starting at Array[byte_offset]
+void BrickPiDecodeValues(unsigned char i, unsigned char byte_offset){
+  unsigned int ii = 0;
+  
+  Bit_Offset = 0;
+  
+  unsigned char Temp_BitsUsed[2] = {0, 0};         // Used for encoder values
+  Temp_BitsUsed[0] = GetBits(byte_offset, 0, 5);
+  Temp_BitsUsed[1] = GetBits(byte_offset, 0, 5);
+  unsigned long Temp_EncoderVal;
+  
+  ii = 0;
+  while(ii < 2){
+    unsigned char port = ii + (i * 2);
+    Temp_EncoderVal = GetBits(byte_offset, 0, Temp_BitsUsed[ii]);
+    if(Temp_EncoderVal & 0x01){
+      Temp_EncoderVal /= 2;
+      BrickPi.Encoder[port] = Temp_EncoderVal * (-1);}
+    else{
+      BrickPi.Encoder[port] = (Temp_EncoderVal / 2);}
+    ii++;
+  }
+  
+  ii = 0;
+  while(ii < 2){
+    unsigned char port = ii + (i * 2);
+    Temp_EncoderVal = GetBits(byte_offset, 0, GetBits(byte_offset, 0, 5));
+    if(Temp_EncoderVal & 0x01){
+      BrickPi.EncoderVelocity[port] = ((Temp_EncoderVal / 2) * (-1));}
+    else{
+      BrickPi.EncoderVelocity[port] = (Temp_EncoderVal / 2);}
+    ii++;
+  }
+  
+  BrickPi.EncoderTime[i] = GetBits(byte_offset, 0, 32);
+
+  ii = 0;
+  while(ii < 2){
+    unsigned char port = ii + (i * 2);
+    switch(BrickPi.SensorType[port]){
+      case TYPE_SENSOR_TOUCH:
+        BrickPi.Sensor[port] = GetBits(byte_offset, 0, 1);
+      break;
+      case TYPE_SENSOR_ULTRASONIC_CONT:
+      case TYPE_SENSOR_ULTRASONIC_SS:
+        BrickPi.Sensor[port] = GetBits(byte_offset, 0, 8);
+      break;
+      case TYPE_SENSOR_COLOR_FULL:
+        BrickPi.Sensor[port] = GetBits(byte_offset, 0, 3);
+        BrickPi.SensorArray[port][INDEX_BLANK] = GetBits(byte_offset, 0, 10);
+        BrickPi.SensorArray[port][INDEX_RED  ] = GetBits(byte_offset, 0, 10);                
+        BrickPi.SensorArray[port][INDEX_GREEN] = GetBits(byte_offset, 0, 10);
+        BrickPi.SensorArray[port][INDEX_BLUE ] = GetBits(byte_offset, 0, 10);
+      break;          
+      case TYPE_SENSOR_I2C:
+      case TYPE_SENSOR_I2C_9V:
+        BrickPi.Sensor[port] = GetBits(byte_offset, 0, BrickPi.SensorI2CDevices[port]);
+        unsigned char device = 0;
+        while(device < BrickPi.SensorI2CDevices[port]){
+          if(BrickPi.Sensor[port] & (0x01 << device)){
+            unsigned char in_byte = 0;
+            while(in_byte < BrickPi.SensorI2CRead[port][device]){
+              BrickPi.SensorI2CIn[port][device][in_byte] = GetBits(byte_offset, 0, 8);
+              in_byte++;
+            }
+          }
+          device++;
+        }
+      break;      
+      case TYPE_SENSOR_LIGHT_OFF:
+      case TYPE_SENSOR_LIGHT_ON:
+      case TYPE_SENSOR_RCX_LIGHT:
+      case TYPE_SENSOR_COLOR_RED:
+      case TYPE_SENSOR_COLOR_GREEN:
+      case TYPE_SENSOR_COLOR_BLUE:
+      case TYPE_SENSOR_COLOR_NONE:
+      default:
+        BrickPi.Sensor[(ii + (i * 2))] = GetBits(byte_offset, 0, BrickPiAnalogBits(port));
+    }        
+    ii++;
+  }
+}
+
+/*
+  Update statistics. Every update records, for each BrickPi uC, how long each phase of it took:
+  
+    STATS_ENCODE      BrickPiEncodeValues
+    STATS_TX          BrickPiTx, until the last byte has left the UART. The MSG_TYPE_VALUES_ALL broadcast counts for every uC.
+    STATS_TURNAROUND  From the end of BrickPiTx until the first byte of the reply arrived. This is the uC handling the message,
+                      plus waiting for its time slot for MSG_TYPE_VALUES_ALL.
+    STATS_RX          From the first byte of the reply until all of it had arrived
+    STATS_DECODE      BrickPiDecodeValues
+  
+  Each phase has a histogram of 16 buckets for 0 - 15 uS, and then 8 buckets for each power of 2, so every time is recorded
+  to within 12.5% without keeping the times themselves. The BrickPiRx errors (indexed by -error) and the retries are counted
+  for each uC as well. MSG_TYPE_VALUES_ALL errors are counted for the first uC that hadn't replied yet.
+  
+  BrickPiStatsPercentile reads the histograms, BrickPiStatsPrint prints everything, and BrickPiStatsReset starts again.
+  BrickPiGetFWStats reads the FW's own counters (MSG_TYPE_STATS), which BrickPiStatsPrint prints alongside.
+  With the update thread, the statistics are written by the thread, so a reader can see an update half recorded.
+*/
+
+#define STATS_ENCODE     0
+#define STATS_TX         1
+#define STATS_TURNAROUND 2
+#define STATS_RX         3
+#define STATS_DECODE     4
+#define STATS_PHASES     5
+
+#define STATS_BUCKETS  240                   // 16 + (8 * 28), for times of up to 32 bits
+#define STATS_ERRORS     7                   // BrickPiRx errors -1 to -6
+
+struct BrickPiHistogram{
+  unsigned long      Count;
+  unsigned long      Min;
+  unsigned long      Max;
+  unsigned long long Sum;
+  unsigned long      Bucket[STATS_BUCKETS];
+};
+
+struct BrickPiStatsStruct{
+  struct BrickPiHistogram Phase    [NUMBER_OF_BRICKPIS * 2][STATS_PHASES];
+  unsigned long           RxErrors [NUMBER_OF_BRICKPIS * 2][STATS_ERRORS];   // How many times BrickPiRx returned each error
+  unsigned long           Retries  [NUMBER_OF_BRICKPIS * 2];                 // How many MSG_TYPE_VALUES messages were sent again
+};
+
+struct BrickPiStatsStruct BrickPiStats;
+int BrickPiStatsEnable = 1;                  // Set to 0 to stop recording
+
+const char *BrickPiStatsPhaseNames[STATS_PHASES] = {"encode", "tx", "turnaround", "rx", "decode"};
+
+unsigned long RxStartUs;                     // When the first byte of the message at the start of RxFrame arrived
+unsigned long RxFillUs;                      // When BrickPiRxFill last received any bytes
+unsigned long RxTakenStartUs;                // When the first and last bytes of the last message taken by BrickPiRxTake arrived
+unsigned long RxTakenEndUs;
+
+void BrickPiStatsReset(){
+  memset(&BrickPiStats, 0, sizeof(BrickPiStats));
+}
+
+// The histogram bucket for a time of "value" uS
+unsigned char BrickPiStatsBucket(unsigned long value){
+  if(value > 0xFFFFFFFF)
+    value = 0xFFFFFFFF;
+  if(value < 16)
+    return value;
+  unsigned char shift = 1;
+  while((value >> shift) > 15)
+    shift++;
+  return (16 + ((shift - 1) * 8) + ((value >> shift) - 8));
+}
+
+// The highest time that is recorded in bucket "bucket"
+unsigned long BrickPiStatsBucketMax(unsigned char bucket){
+  if(bucket < 16)
+    return bucket;
+  unsigned char shift = (((bucket - 16) / 8) + 1);
+  return ((((unsigned long)(9 + ((bucket - 16) % 8))) << shift) - 1);
+}
+
+// Record that phase "phase" of the update of uC "i" took "us" uS
+void BrickPiStatsAdd(unsigned char i, unsigned char phase, unsigned long us){
+  if(!BrickPiStatsEnable)
+    return;
+  struct BrickPiHistogram *h = &BrickPiStats.Phase[i][phase];
+  if(h->Count == 0 || us < h->Min)
+    h->Min = us;
+  if(us > h->Max)
+    h->Max = us;
+  h->Count++;
+  h->Sum += us;
+  h->Bucket[BrickPiStatsBucket(us)]++;
+}
+
+// Record BrickPiRx error "error" for uC "i"
+void BrickPiStatsRxError(unsigned char i, int error){
+  if(BrickPiStatsEnable && error < 0 && error >= -STATS_ERRORS)
+    BrickPiStats.RxErrors[i][-error]++;
+}
+
+// Record the turnaround and rx times of the reply that was just received from uC "i", for a message sent at "sent"
+void BrickPiStatsReply(unsigned char i, unsigned long sent){
+  BrickPiStatsAdd(i, STATS_TURNAROUND, (RxTakenStartUs - sent));
+  BrickPiStatsAdd(i, STATS_RX, (RxTakenEndUs - RxTakenStartUs));
+}
+
+// The time in uS that "percentile" percent of phase "phase" of the updates of uC "i" took no longer than (to within 12.5%)
+unsigned long BrickPiStatsPercentile(unsigned char i, unsigned char phase, double percentile){
+  struct BrickPiHistogram *h = &BrickPiStats.Phase[i][phase];
+  if(h->Count == 0)
+    return 0;
+  unsigned long Target = (unsigned long)(((h->Count * percentile) / 100) + 0.5);
+  if(Target < 1)
+    Target = 1;
+  unsigned long Total = 0;
+  unsigned char bucket = 0;
+  while(bucket < (STATS_BUCKETS - 1)){
+    Total += h->Bucket[bucket];
+    if(Total >= Target)
+      break;
+    bucket++;
+  }
+  return Min(BrickPiStatsBucketMax(bucket), h->Max);
+}
+
+// The FW's own counters, from MSG_TYPE_STATS. They count since the uC was reset, or since they were cleared.
+struct BrickPiFWStatsStruct{
+  unsigned char Valid;                       // Set once BrickPiGetFWStats has read them
+  unsigned long Loops;                       // loop() passes
+  unsigned long Replies;                     // Addressed messages handled
+  unsigned long ReplySum;                    // uS from receiving those messages to queueing the replies, summed
+  unsigned long ReplyMax;                    //   '' the longest
+  unsigned int  UARTErrors [4];              // UART_ReadFrame errors -3 (another uC's address), -4 (header cut short), -5 (checksum) and -6 (length)
+  unsigned long EncoderISR [2];              // Encoder interrupts for PORT_A and PORT_B
+  unsigned int  Timeouts;                    // How many times the communication timeout floated the motors
+  unsigned int  I2CErrors  [2][8];           // Failed transfers for each device on each sensor port
+  unsigned int  Repeats;                     // MSG_TYPE_VALUES retries of a message that it had already handled
+};
+
+struct BrickPiFWStatsStruct BrickPiFWStats[NUMBER_OF_BRICKPIS * 2];
+
+// Read "bytes" bytes from "Array", low byte first
+unsigned long BrickPiStatsGet(unsigned char byte_offset, unsigned char bytes){
+  unsigned long value = 0;
+  while(bytes){
+    bytes--;
+    value = ((value << 8) | Array[byte_offset + bytes]);
+  }
+  return value;
+}
+
+// Read the FW's counters from uC "i" into BrickPiFWStats[i]. If "clear" is set, the FW clears them after replying.
+int BrickPiGetFWStats(unsigned char i, int clear){
+  Array[BYTE_MSG_TYPE] = MSG_TYPE_STATS;
+  Array[BYTE_STATS_CLEAR] = (clear ? 1 : 0);
+  BrickPiTx(BrickPi.Address[i], 2, Array);
+  if(BrickPiRx(&BytesReceived, Array, 100000))
+    return -1;
+  if(!(BytesReceived == STATS_BYTES && Array[BYTE_MSG_TYPE] == MSG_TYPE_STATS))
+    return -1;
+  struct BrickPiFWStatsStruct *FW = &BrickPiFWStats[i];
+  FW->Loops    = BrickPiStatsGet(BYTE_STATS_LOOPS,     4);
+  FW->Replies  = BrickPiStatsGet(BYTE_STATS_REPLIES,   4);
+  FW->ReplySum = BrickPiStatsGet(BYTE_STATS_REPLY_SUM, 4);
+  FW->ReplyMax = BrickPiStatsGet(BYTE_STATS_REPLY_MAX, 4);
+  unsigned char ii = 0;
+  while(ii < 4){
+    FW->UARTErrors[ii] = BrickPiStatsGet((BYTE_STATS_UART_ERRORS + (ii * 2)), 2);
+    ii++;
+  }
+  FW->EncoderISR[PORT_A] = BrickPiStatsGet(BYTE_STATS_ENCODER_ISR,      4);
+  FW->EncoderISR[PORT_B] = BrickPiStatsGet((BYTE_STATS_ENCODER_ISR + 4), 4);
+  FW->Timeouts = BrickPiStatsGet(BYTE_STATS_TIMEOUTS, 2);
+  ii = 0;
+  while(ii < 16){
+    FW->I2CErrors[ii / 8][ii % 8] = BrickPiStatsGet((BYTE_STATS_I2C_ERRORS + (ii * 2)), 2);
+    ii++;
+  }
+  FW->Repeats = BrickPiStatsGet(BYTE_STATS_REPEATS, 2);
+  FW->Valid = 1;
+  return 0;
+}
+
+// Print the statistics as text, with the FW's counters for each uC that BrickPiGetFWStats has read
+void BrickPiStatsPrint(FILE *file){
+  unsigned char i = 0;
+  while(i < (NUMBER_OF_BRICKPIS * 2)){
+    fprintf(file, "Address %d\n", BrickPi.Address[i]);
+    unsigned char phase = 0;
+    while(phase < STATS_PHASES){
+      struct BrickPiHistogram *h = &BrickPiStats.Phase[i][phase];
+      fprintf(file, "  %-10s count %8lu  min %6lu  mean %8.1f  p50 %6lu  p90 %6lu  p99 %6lu  max %6lu uS\n",
+        BrickPiStatsPhaseNames[phase], h->Count, h->Min, (h->Count ? ((double)h->Sum / h->Count) : 0.0),
+        BrickPiStatsPercentile(i, phase, 50), BrickPiStatsPercentile(i, phase, 90), BrickPiStatsPercentile(i, phase, 99), h->Max);
+      phase++;
+    }
+    fprintf(file, "  errors     timeout (-2) %lu  header (-4) %lu  checksum (-5) %lu  length (-6) %lu  UART (-1) %lu  retries %lu\n",
+      BrickPiStats.RxErrors[i][2], BrickPiStats.RxErrors[i][4], BrickPiStats.RxErrors[i][5], BrickPiStats.RxErrors[i][6],
+      BrickPiStats.RxErrors[i][1], BrickPiStats.Retries[i]);
+    struct BrickPiFWStatsStruct *FW = &BrickPiFWStats[i];
+    if(FW->Valid){
+      fprintf(file, "  FW         loops %lu  replies %lu  mean %.1f  max %lu uS  encoder ISR %lu %lu  timeouts %u  repeats %u\n",
+        FW->Loops, FW->Replies, (FW->Replies ? ((double)FW->ReplySum / FW->Replies) : 0.0), FW->ReplyMax,
+        FW->EncoderISR[PORT_A], FW->EncoderISR[PORT_B], FW->Timeouts, FW->Repeats);
+      fprintf(file, "  FW errors  address (-3) %u  header (-4) %u  checksum (-5) %u  length (-6) %u",
+        FW->UARTErrors[0], FW->UARTErrors[1], FW->UARTErrors[2], FW->UARTErrors[3]);
+      unsigned char ii = 0;
+      while(ii < 16){
+        if(FW->I2CErrors[ii / 8][ii % 8])
+          fprintf(file, "  I2C port %d device %d: %u", ((ii / 8) + 1), (ii % 8), FW->I2CErrors[ii / 8][ii % 8]);
+        ii++;
+      }
+      fprintf(file, "\n");
+    }
+    i++;
+  }
+}
+
+/*
+  Health of each BrickPi uC. When a uC fails an update (no good reply, even after retrying), the update carries on with the
+  other uCs, and the one that failed backs off. It's skipped for BrickPiBackoffMin uS, doubling with each failed update in a
+  row up to BrickPiBackoffMax, and then it's tried once, without retries. So a uC that has stopped answering costs the
+  others one reply timeout per backoff, instead of 5 in every update. Its first good reply makes it healthy again.
+  
+  BrickPiControllerResult has what happened to each uC in the last update.
+*/
+
+#define CONTROLLER_UPDATED  0                // Updated
+#define CONTROLLER_FAILED  -1                // No good reply
+#define CONTROLLER_SKIPPED -2                // Not tried, because it's backing off
+
+unsigned long BrickPiBackoffMin = 20000;     // uS
+unsigned long BrickPiBackoffMax = 1000000;   // uS
+
+struct BrickPiHealthStruct{
+  unsigned long Failures;                    // Failed updates in a row. 0 while it's healthy.
+  unsigned long RetryAt;                     // When it's tried again, while it's backing off
+};
+
+struct BrickPiHealthStruct BrickPiHealth [NUMBER_OF_BRICKPIS * 2];
+int BrickPiControllerResult              [NUMBER_OF_BRICKPIS * 2];
+
+// Determine if uC "i" should be tried in this update
+int BrickPiHealthDue(unsigned char i){
+  return (BrickPiHealth[i].Failures == 0 || (long)(CurrentTickUs() - BrickPiHealth[i].RetryAt) >= 0);
+}
+
+// How many times to retry uC "i" if it doesn't reply properly
+unsigned char BrickPiHealthRetries(unsigned char i){
+  return (BrickPiHealth[i].Failures ? 0 : 4);
+}
+
+// Record the result of updating uC "i"
+void BrickPiHealthResult(unsigned char i, int result){
+  BrickPiControllerResult[i] = result;
+  if(result == CONTROLLER_UPDATED){
+    BrickPiHealth[i].Failures = 0;
+  }else if(result == CONTROLLER_FAILED){
+    unsigned long Backoff = BrickPiBackoffMin;
+    unsigned long f = BrickPiHealth[i].Failures;
+    while(f && Backoff < BrickPiBackoffMax){
+      Backoff *= 2;
+      f--;
+    }
+    BrickPiHealth[i].Failures++;
+    BrickPiHealth[i].RetryAt = (CurrentTickUs() + Min(Backoff, BrickPiBackoffMax));
+  }
+}
+
+unsigned char Retried = 0; // For re-trying a failed update.
+
+int BrickPiValuesAll = 0;                    // Set to 1 to update all the BrickPi uCs with one MSG_TYPE_VALUES_ALL broadcast. Requires FW that supports MSG_TYPE_VALUES_ALL.
+unsigned long BrickPiSlotTurnaround = 500;  // uS from a uC receiving MSG_TYPE_VALUES_ALL to it starting its reply. The FW replies with the readings it has
+                                             // already taken, so this is just handling the motor values and encoding the reply (up to about 400 uS).
+
+#define SLOT_GUARD_BYTES 2                   // Byte times left between the end of one uC's reply and the start of the next uC's time slot
+
+#define VALUES_ALL_MAX_BYTES 61              // The BrickPi FW receives into the 64 byte Arduino Serial buffer, which has to hold the 3 header bytes too.
+
+// Determine the largest MSG_TYPE_VALUES reply that BrickPi uC "i" could send, in bits, not counting the MSG_TYPE and sequence number bytes
+unsigned int BrickPiReplyBits(unsigned char i){
+  unsigned int bits = (5 + 5 + 32 + 32);     // Two encoder lengths, and two encoder values of up to 32 bits
+  bits += (2 * (5 + 17));                    // Two velocity lengths and values, up to 65535 ticks per second and the sign
+  bits += 32;                                // The sample time
+  unsigned char ii = 0;
+  while(ii < 2){
+    unsigned char port = ii + (i * 2);
+    switch(BrickPi.SensorType[port]){
+      case TYPE_SENSOR_TOUCH:
+        bits += 1;
+      break;
+      case TYPE_SENSOR_ULTRASONIC_CONT:
+      case TYPE_SENSOR_ULTRASONIC_SS:
+        bits += 8;
+      break;
+      case TYPE_SENSOR_COLOR_FULL:
+        bits += (3 + (4 * 10));
+      break;
+      case TYPE_SENSOR_I2C:
+      case TYPE_SENSOR_I2C_9V:
+        bits += BrickPi.SensorI2CDevices[port];
+        unsigned char device = 0;
+        while(device < BrickPi.SensorI2CDevices[port]){
+          bits += (BrickPi.SensorI2CRead[port][device] * 8);
+          device++;
+        }
+      break;
+      default:
+        bits += BrickPiAnalogBits(port);
+    }
+    ii++;
+  }
+  return bits;
+}
+
+// Determine the width of the MSG_TYPE_VALUES_ALL reply time slots, in 100 uS units. Every slot is wide enough for the largest reply, plus
+// BrickPiSlotTurnaround (the first uC only starts replying after that) and SLOT_GUARD_BYTES. Returns 0 if that's too wide for BYTE_SLOT_TIME.
+unsigned char BrickPiSlotTime(){
+  unsigned long MaxBytes = 0;
+  unsigned char i = 0;
+  while(i < (NUMBER_OF_BRICKPIS * 2)){
+    unsigned long Bytes = (2 + 3 + ((BrickPiReplyBits(i) + 7) / 8));   // CHECKSUM and BYTE_COUNT, MSG_TYPE, address and sequence number, and the values
+    if(Bytes > MaxBytes)
+      MaxBytes = Bytes;
+    i++;
+  }
+  unsigned long SlotUs = ((((MaxBytes + SLOT_GUARD_BYTES) * 10 * 1000) / (BaudRate / 1000)) + BrickPiSlotTurnaround);
+  unsigned long SlotTime = ((SlotUs + 99) / 100);
+  if(SlotTime > 255)
+    return 0;
+  return SlotTime;
+}
+
+/*
+  BrickPiUpdateValues is split into three steps, so that the application can do other work while the messages are in flight:
+  
+    BrickPiUpdateBegin   Encode the values for every BrickPi uC, and send the first message.
+    BrickPiUpdatePoll    Receive whatever has arrived, and send the next message, without waiting. Returns 1 once the update is ready to finish.
+    BrickPiUpdateFinish  Wait for anything still outstanding, and decode the replies into BrickPi.
+  
+  The motor values are encoded by BrickPiUpdateBegin, so changing them before BrickPiUpdateFinish affects the next update, not this one.
+  The sensor and encoder values in BrickPi are only changed by BrickPiUpdateFinish.
+  
+  If BrickPiValuesAll is set, BrickPiUpdateBegin sends one MSG_TYPE_VALUES_ALL broadcast. Each uC replies in its own time slot, in the order
+  of BrickPi.Address, and any uC that doesn't reply is updated with its own MSG_TYPE_VALUES message by BrickPiUpdateFinish. If the
+  values don't fit in one message, or the time slots would be too wide for BYTE_SLOT_TIME (at low baud rates), it's updated as if it wasn't set.
+  Otherwise BrickPiUpdatePoll sends a MSG_TYPE_VALUES message to each uC in turn, as the reply from the previous one arrives (or it's given up on).
+  Either way, a uC that's backing off (see BrickPiHealth) is skipped.
+  
+  Each MSG_TYPE_VALUES message has a sequence number, and a retry (including the MSG_TYPE_VALUES message after a missing MSG_TYPE_VALUES_ALL
+  reply) is the same message with the same sequence number. A uC that already handled it just sends the same reply again, so the encoder
+  offsets aren't subtracted twice. They're removed from BrickPi.EncoderOffset once there's a reply with the sequence number. If the update
+  fails before then, the uC might or might not have them, so the message is held, and the next update sends it again as is, with the same
+  sequence number, until a reply confirms it. Until then that uC doesn't get new motor values. A message without offsets isn't held.
+  The uC only remembers its last message until it's sent anything else (e.g. BrickPiSetupSensors, which releases a held message) or its
+  communication times out, so offsets held across those could still be applied twice.
+  
+  The update returns -1 unless every uC was updated, but the uCs that were are still decoded into BrickPi. BrickPiControllerResult says which.
+*/
+
+#define UPDATE_IDLE    0                     // No update in progress
+#define UPDATE_WAITING 1                     // Waiting for replies
+#define UPDATE_READY   2                     // Every reply has been received, or given up on
+
+unsigned char UpdateState = UPDATE_IDLE;
+unsigned char UpdateAll;                     // This update uses MSG_TYPE_VALUES_ALL
+unsigned char UpdateController;              // The uC that the current MSG_TYPE_VALUES message was sent to
+unsigned long UpdateDeadline;                // When to give up waiting for the current reply(s)
+unsigned long UpdateSent;                    // When the last byte of the current message left the UART
+int           UpdateResult;
+
+unsigned char UpdateSeq;                                      // The last sequence number used
+unsigned char UpdateTx      [NUMBER_OF_BRICKPIS * 2][128];    // The encoded MSG_TYPE_VALUES message for each uC
+unsigned char UpdateTxBytes [NUMBER_OF_BRICKPIS * 2];
+unsigned char UpdateRx      [NUMBER_OF_BRICKPIS * 2][256];    // The reply from each uC
+unsigned char UpdateReplied [NUMBER_OF_BRICKPIS * 2];
+long          UpdateOffsets [NUMBER_OF_BRICKPIS * 4];         // The encoder offsets in UpdateTx. Removed from BrickPi.EncoderOffset once a reply confirms that the uC has them.
+
+// Encode the MSG_TYPE_VALUES message for uC "i" into UpdateTx, unless the last one had encoder offsets that no reply has confirmed yet.
+// Then that one is held, to be sent again as is.
+void BrickPiUpdateEncode(unsigned char i){
+  if(UpdateOffsets[((i * 2) + PORT_A)] || UpdateOffsets[((i * 2) + PORT_B)])
+    return;
+  memset(Array, 0, 256);
+  Array[BYTE_MSG_TYPE] = MSG_TYPE_VALUES;
+  do{
+    UpdateSeq++;
+  }while(UpdateSeq == 0 || UpdateSeq == UpdateTx[i][BYTE_VALUES_SEQ]);   // 0 never matches a uC that has nothing to repeat, and the uC could still repeat the last one it got
+  Array[BYTE_VALUES_SEQ] = UpdateSeq;
+  unsigned long Tick = CurrentTickUs();
+  UpdateTxBytes[i] = (BrickPiEncodeValues(i, BYTE_VALUES_BITS) + BYTE_VALUES_BITS);
+  BrickPiStatsAdd(i, STATS_ENCODE, (CurrentTickUs() - Tick));
+  memcpy(UpdateTx[i], Array, UpdateTxBytes[i]);
+  UpdateOffsets[((i * 2) + PORT_A)] = BrickPi.EncoderOffset[((i * 2) + PORT_A)];
+  UpdateOffsets[((i * 2) + PORT_B)] = BrickPi.EncoderOffset[((i * 2) + PORT_B)];
+}
+
+// If "Reply" ("Bytes" long) is the reply to the MSG_TYPE_VALUES message in UpdateTx for uC "i", with the sequence number at Reply[seq_offset]
+int BrickPiUpdateMatches(unsigned char i, unsigned char *Reply, unsigned char Bytes, unsigned char msg_type, unsigned char seq_offset){
+  return (Bytes > seq_offset && Reply[BYTE_MSG_TYPE] == msg_type && Reply[seq_offset] == UpdateTx[i][BYTE_VALUES_SEQ]);
+}
+
+// uC "i" received the encoder offsets and motor targets, so don't send them again
+void BrickPiUpdateOffsetsSent(unsigned char i){
+  BrickPi.EncoderOffset[((i * 2) + PORT_A)] -= UpdateOffsets[((i * 2) + PORT_A)];
+  BrickPi.EncoderOffset[((i * 2) + PORT_B)] -= UpdateOffsets[((i * 2) + PORT_B)];
+  UpdateOffsets[((i * 2) + PORT_A)] = 0;
+  UpdateOffsets[((i * 2) + PORT_B)] = 0;
+  BrickPiTargetsSent(i);
+}
+
+// uC "i" is being sent something other than MSG_TYPE_VALUES, so it won't repeat its last reply. Don't hold the last message; the next
+// update encodes a new one, with the offsets that are still in BrickPi.EncoderOffset.
+void BrickPiUpdateRelease(unsigned char i){
+  UpdateOffsets[((i * 2) + PORT_A)] = 0;
+  UpdateOffsets[((i * 2) + PORT_B)] = 0;
+}
+
+void BrickPiUpdateSend(unsigned char i){
+  UpdateController = i;
+  unsigned long Tick = CurrentTickUs();
+  BrickPiTx(BrickPi.Address[i], UpdateTxBytes[i], UpdateTx[i]);
+  UpdateSent = CurrentTickUs();
+  BrickPiStatsAdd(i, STATS_TX, (UpdateSent - Tick));
+  UpdateDeadline = (UpdateSent + 25000);
+}
+
+// Send the MSG_TYPE_VALUES message to the first uC from "i" on that isn't backing off. If there isn't one, the update is ready to finish.
+void BrickPiUpdateNext(unsigned char i){
+  while(i < (NUMBER_OF_BRICKPIS * 2) && !BrickPiHealthDue(i)){
+    BrickPiControllerResult[i] = CONTROLLER_SKIPPED;
+    UpdateResult = -1;
+    i++;
+  }
+  if(i < (NUMBER_OF_BRICKPIS * 2) && !BrickPiStopped){
+    Retried = 0;
+    BrickPiUpdateSend(i);
+  }else{
+    UpdateState = UPDATE_READY;
+  }
+}
+
+// Update uC "i" with its own MSG_TYPE_VALUES message (the one BrickPiUpdateBegin encoded into UpdateTx), and get the latest values
+int BrickPiUpdateController(unsigned char i){
+  Retried = 0;
+  while(1){
+    if(BrickPiStopped)                          // Leave the UART to BrickPiEmergencyStop
+      return -1;
+    BrickPiUpdateSend(i);
+    int result = BrickPiRx(&BytesReceived, UpdateRx[i], 25000);
+    if(result)
+      BrickPiStatsRxError(i, result);
+    else
+      BrickPiStatsReply(i, UpdateSent);
+    if(!result && BrickPiUpdateMatches(i, UpdateRx[i], BytesReceived, MSG_TYPE_VALUES, BYTE_VALUES_SEQ))
+      break;
+#ifdef DEBUG
+    printf("BrickPiRx error: %d\n", result);
+#endif
+    if(Retried >= BrickPiHealthRetries(i)){
+#ifdef DEBUG
+      printf("Retry failed.\n");
+#endif
+      return -1;
+    }
+    Retried++;
+    BrickPiStats.Retries[i]++;
+  }
+  
+  BrickPiUpdateOffsetsSent(i);
+  memcpy(Array, UpdateRx[i], 256);
+  unsigned long Tick = CurrentTickUs();
+  BrickPiDecodeValues(i, BYTE_VALUES_BITS);
+  BrickPiStatsAdd(i, STATS_DECODE, (CurrentTickUs() - Tick));
+  return 0;
+}
+
+// Start updating the BrickPi
+int BrickPiUpdateBegin(){
+  unsigned char i = 0;
+  if(UpdateState != UPDATE_IDLE || BrickPiStopped)
+    return -1;
+  
+  BrickPiUpdateLEDs();
+  
+  while(i < (NUMBER_OF_BRICKPIS * 2)){
+    BrickPiUpdateEncode(i);
+    UpdateReplied[i] = 0;
+    BrickPiControllerResult[i] = CONTROLLER_FAILED;
+    i++;
+  }
+  UpdateResult = 0;
+  UpdateState = UPDATE_WAITING;
+  
+  UpdateAll = 0;
+  unsigned char SlotTime = (BrickPiValuesAll ? BrickPiSlotTime() : 0);
+  if(SlotTime){
+    memset(Array, 0, 256);
+    Array[BYTE_MSG_TYPE] = MSG_TYPE_VALUES_ALL;
+    Array[BYTE_SLOT_TIME] = SlotTime;
+    unsigned int UART_TX_BYTES = BYTE_SECTIONS;
+    i = 0;
+    while(i < (NUMBER_OF_BRICKPIS * 2) && (UART_TX_BYTES + 2 + (UpdateTxBytes[i] - 1)) <= VALUES_ALL_MAX_BYTES){
+      Array[UART_TX_BYTES] = BrickPi.Address[i];
+      Array[UART_TX_BYTES + 1] = (UpdateTxBytes[i] - 1);
+      memcpy(&Array[UART_TX_BYTES + 2], &UpdateTx[i][1], (UpdateTxBytes[i] - 1));
+      UART_TX_BYTES += (2 + (UpdateTxBytes[i] - 1));
+      i++;
+    }
+    if(i == (NUMBER_OF_BRICKPIS * 2)){          // Otherwise it's too much to send in one message
+      UpdateAll = 1;
+      unsigned long Tick = CurrentTickUs();
+      BrickPiTx(0, UART_TX_BYTES, Array);
+      UpdateSent = CurrentTickUs();
+      i = 0;
+      while(i < (NUMBER_OF_BRICKPIS * 2)){
+        BrickPiStatsAdd(i, STATS_TX, (UpdateSent - Tick));
+        i++;
+      }
+      UpdateDeadline = (UpdateSent + (SlotTime * 100 * (NUMBER_OF_BRICKPIS * 2)) + 25000);
+      return 0;
+    }
+  }
+  
+  BrickPiUpdateNext(0);
+  return 0;
+}
+
+// Receive any replies that have arrived, without waiting. Returns 1 when the update is ready for BrickPiUpdateFinish, 0 if not, or -1.
+int BrickPiUpdatePoll(){
+  unsigned char Bytes;
+  unsigned char i;
+  int result;
+  
+  while(UpdateState == UPDATE_WAITING){
+    if(BrickPiStopped){                         // Leave the UART to BrickPiEmergencyStop
+      UpdateResult = -1;
+      UpdateState = UPDATE_READY;
+      break;
+    }
+    result = BrickPiRxReady();
+    if(result == -1)
+      return -1;
+    if(result == 0){
+      if((long)(CurrentTickUs() - UpdateDeadline) < 0)
+        return 0;
+      result = BrickPiRxTimeout();
+    }else if(UpdateAll){
+      result = BrickPiRxTake(&Bytes, Array);
+    }else{
+      result = BrickPiRxTake(&Bytes, UpdateRx[UpdateController]);
+    }
+    
+    if(UpdateAll){
+      if(result){
+        i = 0;
+        while(i < (NUMBER_OF_BRICKPIS * 2) && UpdateReplied[i])   // The uC whose time slot it is
+          i++;
+        if(i < (NUMBER_OF_BRICKPIS * 2))
+          BrickPiStatsRxError(i, result);
+      }
+      if(result == -2 || result == -4 || result == -6){     // Nothing more is coming
+        UpdateState = UPDATE_READY;
+        break;
+      }
+      if(result || Bytes < 2 || Array[BYTE_MSG_TYPE] != MSG_TYPE_VALUES_ALL)
+        continue;
+      i = 0;
+      while(i < (NUMBER_OF_BRICKPIS * 2)){
+        if(BrickPi.Address[i] == Array[BYTE_REPLY_ADDRESS] && !UpdateReplied[i]
+        && BrickPiUpdateMatches(i, Array, Bytes, MSG_TYPE_VALUES_ALL, (BYTE_REPLY_ADDRESS + 1))){
+          BrickPiUpdateOffsetsSent(i);
+          BrickPiStatsReply(i, UpdateSent);
+          BrickPiHealthResult(i, CONTROLLER_UPDATED);
+          memcpy(UpdateRx[i], Array, Bytes);
+          UpdateReplied[i] = 1;
+          break;
+        }
+        i++;
+      }
+      i = 0;
+      while(i < (NUMBER_OF_BRICKPIS * 2) && UpdateReplied[i])
+        i++;
+      if(i == (NUMBER_OF_BRICKPIS * 2))
+        UpdateState = UPDATE_READY;
+      continue;
+    }
+    
+    if(result)
+      BrickPiStatsRxError(UpdateController, result);
+    else
+      BrickPiStatsReply(UpdateController, UpdateSent);
+    
+    if(result || !BrickPiUpdateMatches(UpdateController, UpdateRx[UpdateController], Bytes, MSG_TYPE_VALUES, BYTE_VALUES_SEQ)){
+#ifdef DEBUG
+      printf("BrickPiRx error: %d\n", result);
+#endif
+      if(Retried < BrickPiHealthRetries(UpdateController) && !BrickPiStopped){
+        Retried++;
+        BrickPiStats.Retries[UpdateController]++;
+        BrickPiUpdateSend(UpdateController);      // The same message, so if the uC already handled it, it only replies again
+        continue;
+      }
+#ifdef DEBUG
+      printf("Retry failed.\n");
+#endif
+      BrickPiHealthResult(UpdateController, CONTROLLER_FAILED);
+      UpdateResult = -1;
+      BrickPiUpdateNext(UpdateController + 1);    // The other uCs still get their update
+      continue;
+    }
+    
+    BrickPiUpdateOffsetsSent(UpdateController);
+    UpdateReplied[UpdateController] = 1;
+    BrickPiHealthResult(UpdateController, CONTROLLER_UPDATED);
+    BrickPiUpdateNext(UpdateController + 1);
+  }
+  
+  return 1;
+}
+
+// Wait for the update to complete, and decode the replies into BrickPi
+int BrickPiUpdateFinish(){
+  unsigned char i = 0;
+  int result;
+  if(UpdateState == UPDATE_IDLE)
+    return -1;
+  
+  while(!(result = BrickPiUpdatePoll())){
+    long Remaining = (UpdateDeadline - CurrentTickUs());
+    if(Remaining <= 0)
+      continue;
+    if(Remaining > 1000)                       // Check for BrickPiEmergencyStop at least every mS
+      Remaining = 1000;
+    if(BrickPiRxWaitMode == RX_WAIT_POLL){
+      if(BrickPiRxWait(Remaining) == -1){
+        result = -1;                           // The UART failed, so the uCs that haven't replied yet never will
+        break;
+      }
+    }else{
+      usleep(100);
+    }
+  }
+  UpdateState = UPDATE_IDLE;
+  if(result == -1 || BrickPiStopped)
+    return -1;
+  
+  while(i < (NUMBER_OF_BRICKPIS * 2)){
+    if(UpdateReplied[i]){
+      memcpy(Array, UpdateRx[i], 256);
+      unsigned long Tick = CurrentTickUs();
+      BrickPiDecodeValues(i, (UpdateAll ? (BYTE_REPLY_ADDRESS + 2) : BYTE_VALUES_BITS));
+      BrickPiStatsAdd(i, STATS_DECODE, (CurrentTickUs() - Tick));
+    }else if(UpdateAll && !BrickPiHealthDue(i)){
+      BrickPiControllerResult[i] = CONTROLLER_SKIPPED;
+      UpdateResult = -1;
+    }else if(UpdateAll && BrickPiStopped){      // Leave the UART to BrickPiEmergencyStop
+      UpdateResult = -1;
+    }else if(UpdateAll){
+#ifdef DEBUG
+      printf("No MSG_TYPE_VALUES_ALL reply from address %d\n", BrickPi.Address[i]);
+#endif
+      if(BrickPiUpdateController(i)){
+        BrickPiHealthResult(i, CONTROLLER_FAILED);
+        UpdateResult = -1;
+      }else{
+        BrickPiHealthResult(i, CONTROLLER_UPDATED);
+      }
+    }
+    i++;
+  }
+  return UpdateResult;
+}
+
+// Update the BrickPi, and get the latest values
+int BrickPiUpdateValues(){
+  if(BrickPiUpdateBegin())
+    return -1;
+  return BrickPiUpdateFinish();
+}
+
+#ifdef BRICKPI_UPDATE_THREAD
+
+/*
+  Optional background update thread. #define BRICKPI_UPDATE_THREAD before including BrickPi.h, and link with -lpthread.
+  
+  The thread runs BrickPiUpdateValues every "period" uS. After each successful update it publishes a copy of BrickPi,
+  which the application reads with BrickPiGetValues. The application stages motor commands with BrickPiSetCommand,
+  and the thread applies them at the start of the next update. Both are seqlocks, so neither side ever waits for the
+  other, and the application never waits for the bus. Commands can be staged before the thread is started, and its first
+  update applies them. If none are waiting to be applied, the thread starts with the motor values already in BrickPi.
+  
+  While the thread is running, the application must not call BrickPiUpdateValues or any of the other functions that
+  use the UART, and must not write to BrickPi directly. The exception is BrickPiEmergencyStop, which the thread gives
+  the UART up to.
+*/
+
+#include <pthread.h>
+#include <sched.h>
+
+// Motor commands staged by the application
+struct BrickPiCommandStruct{
+  int           MotorSpeed             [NUMBER_OF_BRICKPIS * 4];        // Motor speeds, from -255 to 255. For TYPE_MOTOR_FW_SPEED, in encoder ticks per second.
+  unsigned char MotorEnable            [NUMBER_OF_BRICKPIS * 4];        // Motor mode. Float, Speed, Position.
+  long          MotorTarget            [NUMBER_OF_BRICKPIS * 4];        // Motor target position.
+  long          EncoderOffset          [NUMBER_OF_BRICKPIS * 4];        // Encoder offsets. Each call to BrickPiSetCommand adds its offsets, so they're all applied once, even if it's called more than once between updates.
+};
+
+struct BrickPiStruct        BrickPiValues;           // The latest values published by the update thread
+volatile unsigned long      BrickPiValuesSeq = 0;    // Seqlock sequence for BrickPiValues. Odd while it's being written.
+
+struct BrickPiCommandStruct BrickPiCommand;          // The latest motor commands staged by the application
+volatile unsigned long      BrickPiCommandSeq = 0;   // Seqlock sequence for BrickPiCommand. Odd while it's being written.
+volatile unsigned long      BrickPiCommandApplied = 0; // The BrickPiCommandSeq of the commands the thread last applied
+long BrickPiCommandOffsets       [NUMBER_OF_BRICKPIS * 4];   // Every encoder offset staged, added up. BrickPiCommand has this total.
+long BrickPiCommandOffsetsApplied[NUMBER_OF_BRICKPIS * 4];   // How much of that total the thread has added to BrickPi.EncoderOffset
+
+pthread_t                   BrickPiThread;
+volatile int                BrickPiThreadRun = 0;    // Cleared to stop the update thread
+unsigned long               BrickPiThreadPeriod = 10000;
+volatile unsigned long      BrickPiThreadErrors = 0; // How many updates failed since the thread was started
+volatile int                BrickPiThreadBusy = 0;   // Set while the thread is updating, and using the UART
+
+// Copy the latest values published by the update thread into "Values". Returns the version of the values, which goes up by 1 with each successful update.
+unsigned long BrickPiGetValues(struct BrickPiStruct *Values){
+  unsigned long Seq;
+  do{
+    Seq = BrickPiValuesSeq;
+    __sync_synchronize();
+    memcpy(Values, &BrickPiValues, sizeof(struct BrickPiStruct));
+    __sync_synchronize();
+  }while((Seq & 0x01) || Seq != BrickPiValuesSeq);   // Try again if the thread was writing
+  return (Seq / 2);
+}
+
+// Stage motor commands, to be applied by the update thread at the start of the next update. Only one application thread should call this.
+void BrickPiSetCommand(struct BrickPiCommandStruct *Command){
+  int i = 0;
+  while(i < (NUMBER_OF_BRICKPIS * 4)){
+    BrickPiCommandOffsets[i] += Command->EncoderOffset[i];
+    i++;
+  }
+  BrickPiCommandSeq++;
+  __sync_synchronize();
+  memcpy(&BrickPiCommand, Command, sizeof(struct BrickPiCommandStruct));
+  memcpy(BrickPiCommand.EncoderOffset, BrickPiCommandOffsets, sizeof(BrickPiCommandOffsets));   // The total, so offsets the thread hasn't applied yet aren't lost
+  __sync_synchronize();
+  BrickPiCommandSeq++;
 }
 
-// Configure sensors
-int BrickPiSetupSensors(){
-  unsigned char i = 0;
-  while(i < (NUMBER_OF_BRICKPIS * 2)){
-    int ii = 0;
-    while(ii < 256){
-      Array[ii] = 0;
-      ii++;
-    }
-    Bit_Offset = 0;
-    Array[BYTE_MSG_TYPE] = MSG_TYPE_SENSOR_TYPE;
-    Array[BYTE_SENSOR_1_TYPE] = BrickPi.SensorType[PORT_1 + (i * 2)];
-    Array[BYTE_SENSOR_2_TYPE] = BrickPi.SensorType[PORT_2 + (i * 2)];
-    ii = 0;
-    while(ii < 2){
-      unsigned char port = (i * 2) + ii;
-      if(Array[BYTE_SENSOR_1_TYPE + ii] == TYPE_SENSOR_I2C
-      || Array[BYTE_SENSOR_1_TYPE + ii] == TYPE_SENSOR_I2C_9V){
-        AddBits(3, 0, 8, BrickPi.SensorI2CSpeed[port]);
-        
-        if(BrickPi.SensorI2CDevices[port] > 8)
-          BrickPi.SensorI2CDevices[port] = 8;
-        
-        if(BrickPi.SensorI2CDevices[port] == 0)
-          BrickPi.SensorI2CDevices[port] = 1;
-        
-        AddBits(3, 0, 3, (BrickPi.SensorI2CDevices[port] - 1));
-        
-        unsigned char device = 0;
-        while(device < BrickPi.SensorI2CDevices[port]){
-          AddBits(3, 0, 7, (BrickPi.SensorI2CAddr[port][device] >> 1));
-          AddBits(3, 0, 2, BrickPi.SensorSettings[port][device]);
-          if(BrickPi.SensorSettings[port][device] & BIT_I2C_SAME){          
-            AddBits(3, 0, 4, BrickPi.SensorI2CWrite[port][device]);
-            AddBits(3, 0, 4, BrickPi.SensorI2CRead [port][device]);
-            unsigned char out_byte = 0;
-            while(out_byte < BrickPi.SensorI2CWrite[port][device]){
-              AddBits(3, 0, 8, BrickPi.SensorI2COut[port][device][out_byte]);
-              out_byte++;
-            }
-          }
-          device++;
+// Publish BrickPi to the readers
+void BrickPiPublishValues(){
+  BrickPiValuesSeq++;
+  __sync_synchronize();
+  memcpy(&BrickPiValues, &BrickPi, sizeof(struct BrickPiStruct));
+  __sync_synchronize();
+  BrickPiValuesSeq++;
+}
+
+void *BrickPiUpdateThreadMain(void *arg){
+  (void)arg;
+  struct BrickPiCommandStruct Command;
+  unsigned long NextTick = CurrentTickUs();
+  while(BrickPiThreadRun){
+    unsigned long Seq = BrickPiCommandSeq;
+    if(Seq != BrickPiCommandApplied && !(Seq & 0x01)){
+      __sync_synchronize();
+      memcpy(&Command, &BrickPiCommand, sizeof(struct BrickPiCommandStruct));
+      __sync_synchronize();
+      if(Seq == BrickPiCommandSeq){                  // Otherwise the application was writing. Apply it next time.
+        memcpy(BrickPi.MotorSpeed,  Command.MotorSpeed,  sizeof(Command.MotorSpeed));
+        memcpy(BrickPi.MotorEnable, Command.MotorEnable, sizeof(Command.MotorEnable));
+        memcpy(BrickPi.MotorTarget, Command.MotorTarget, sizeof(Command.MotorTarget));
+        int i = 0;
+        while(i < (NUMBER_OF_BRICKPIS * 4)){
+          BrickPi.EncoderOffset[i] += (Command.EncoderOffset[i] - BrickPiCommandOffsetsApplied[i]);
+          BrickPiCommandOffsetsApplied[i] = Command.EncoderOffset[i];
+          i++;
         }
+        BrickPiCommandApplied = Seq;
       }
-      ii++;
     }
-    unsigned char UART_TX_BYTES = (((Bit_Offset + 7) / 8) + 3);
-    BrickPiTx(BrickPi.Address[i], UART_TX_BYTES, Array);
-    if(BrickPiRx(&BytesReceived, Array, 1000000))
-      return -1;
-    if(!(BytesReceived == 1 && Array[BYTE_MSG_TYPE] == MSG_TYPE_SENSOR_TYPE))
-      return -1;
-    i++;
+    
+    BrickPiThreadBusy = 1;
+    __sync_synchronize();                            // BrickPiEmergencyStop sets BrickPiStopped before it checks BrickPiThreadBusy
+    if(BrickPiUpdateValues())
+      BrickPiThreadErrors++;
+    int i = 0;
+    while(i < (NUMBER_OF_BRICKPIS * 2) && BrickPiControllerResult[i] != CONTROLLER_UPDATED)
+      i++;
+    if(i < (NUMBER_OF_BRICKPIS * 2))                 // Publish whatever was updated, even if a uC failed
+      BrickPiPublishValues();
+    BrickPiThreadBusy = 0;
+    
+    NextTick += BrickPiThreadPeriod;
+    long Remaining = (NextTick - CurrentTickUs());
+    if(Remaining > 0)
+      usleep(Remaining);
+    else
+      NextTick = CurrentTickUs();                    // Overran the period. Don't try to catch up.
+  }
+  return NULL;
+}
+
+// Start the update thread, updating every "period" uS. If "priority" isn't 0, try to run the thread with SCHED_FIFO at that priority (requires root).
+int BrickPiStartUpdateThread(unsigned long period, int priority){
+  if(BrickPiThreadRun)
+    return -1;
+  BrickPiThreadPeriod = period;
+  BrickPiThreadErrors = 0;
+  
+  if(BrickPiCommandSeq == BrickPiCommandApplied){   // Nothing staged is waiting, so start with the commands that are already set up in BrickPi
+    struct BrickPiCommandStruct Command;
+    memcpy(Command.MotorSpeed,  BrickPi.MotorSpeed,  sizeof(Command.MotorSpeed));
+    memcpy(Command.MotorEnable, BrickPi.MotorEnable, sizeof(Command.MotorEnable));
+    memcpy(Command.MotorTarget, BrickPi.MotorTarget, sizeof(Command.MotorTarget));
+    memset(Command.EncoderOffset, 0, sizeof(Command.EncoderOffset));
+    BrickPiSetCommand(&Command);
+  }
+  BrickPiPublishValues();
+  
+  BrickPiThreadRun = 1;
+  if(pthread_create(&BrickPiThread, NULL, BrickPiUpdateThreadMain, NULL)){
+    BrickPiThreadRun = 0;
+    return -1;
+  }
+  if(priority){
+    struct sched_param param;
+    param.sched_priority = priority;
+    if(pthread_setschedparam(BrickPiThread, SCHED_FIFO, &param)){
+#ifdef DEBUG
+      printf("Update thread SCHED_FIFO priority %d not set\n", priority);
+#endif
+    }
   }
   return 0;
 }
 
+// Stop the update thread, and wait for it to finish its current update
+void BrickPiStopUpdateThread(){
+  if(!BrickPiThreadRun)
+    return;
+  BrickPiThreadRun = 0;
+  pthread_join(BrickPiThread, NULL);
+}
 
-unsigned char Retried = 0; // For re-trying a failed update.
+#endif
 
-// Update the BrickPi, and get the latest values
-int BrickPiUpdateValues(){
-  BrickPiUpdateLEDs();
+// Set BrickPiStopped and broadcast the E Stop, so that every uC floats its motors. It only writes the one message, and doesn't
+// touch the rx bytes or Array, so it's safe to call from a signal handler, or while the update thread is part way through an update.
+void BrickPiEmergencyStopBroadcast(){
+  unsigned char Stop[1] = {MSG_TYPE_E_STOP};
+  BrickPiStopped = 1;
+  __sync_synchronize();
+  BrickPiTxFrame(0, 1, Stop);
+}
+
+/*
+  Tell the BrickPi to float all motors immidately.
+  
+  The E Stop is broadcast before anything else, so every uC floats its motors as soon as that one message arrives, even
+  part way through an update. Any update in progress gives up (the update thread's too). Once the UART has been handed
+  over, each uC is sent its own E Stop until it acknowledges, for up to BrickPiStopTimeout uS in all. If any uC didn't
+  acknowledge, or the update thread didn't let go of the UART in time, the E Stop is broadcast once more.
+  
+  BrickPiStopSent and BrickPiStopLatency record how long it took. BrickPiStopped stays set, so that nothing drives the
+  motors again until the application clears it.
+  
+  Don't call this from a signal handler; use BrickPiEmergencyStopBroadcast.
+  
+  Returns 0 if every uC acknowledged, or -1.
+*/
+int BrickPiEmergencyStop(){
+  unsigned long Start = CurrentTickUs();
+  unsigned char Stop[1] = {MSG_TYPE_E_STOP};        // Not Array, which an interrupted update could be using
+  unsigned char Reply[256];
+  unsigned char Bytes;
+  int result = 0;
   
   unsigned char i = 0;
-  unsigned int ii = 0;
   while(i < (NUMBER_OF_BRICKPIS * 2)){
-    Retried = 0;    
-    
-    __RETRY_COMMUNICATION__:
-    
-    ii = 0;
-    while(ii < 256){
-      Array[ii] = 0;
-      ii++;
-    }
-    
-    Array[BYTE_MSG_TYPE] = MSG_TYPE_VALUES;
-    
-    Bit_Offset = 0;
-    
-//    AddBits(1, 0, 2, 0);     use this to disable encoder offset
-    
-    ii = 0;                 // use this for encoder offset support
-    while(ii < 2){
-      unsigned char port = (i * 2) + ii;
-      if(BrickPi.EncoderOffset[port]){
-        long Temp_Value = BrickPi.EncoderOffset[port];
-        unsigned char Temp_ENC_DIR = 0;
-        unsigned char Temp_BitsNeeded = 0;
-        
-        AddBits(1, 0, 1, 1);
-        if(Temp_Value < 0){
-          Temp_ENC_DIR = 1;
-          Temp_Value *= (-1);
-        }        
-        Temp_BitsNeeded = BitsNeeded(Temp_Value);
-        AddBits(1, 0, 5, Temp_BitsNeeded);
-        Temp_BitsNeeded++;
-        Temp_Value *= 2;
-        Temp_Value |= Temp_ENC_DIR;
-        AddBits(1, 0, Temp_BitsNeeded, Temp_Value);
-      }
-      else{
-        AddBits(1, 0, 1, 0);
-      }
-      ii++;
-    }
-    
-    int speed;
-    unsigned char dir;    
-    ii = 0;
-    while(ii < 2){
-      unsigned char port = (i * 2) + ii;
-      
-      if(BrickPi.MotorEnable[port] == TYPE_MOTOR_FLOAT){
-        AddBits(1, 0, 10, 0);
-      }else{
-        if(BrickPi.MotorEnable[port] == TYPE_MOTOR_SPEED){
-          speed = BrickPi.MotorSpeed[port];
-        }else if(BrickPi.MotorEnable[port] == TYPE_MOTOR_POSITION){
-          long error = BrickPi.MotorTarget[port] - BrickPi.Encoder[port];
-          float speed_f = (error * BrickPi.MotorTargetKP[port]) + ((error - BrickPi.MotorTargetLastError[port]) * BrickPi.MotorTargetKD[port]);
-          BrickPi.MotorTargetLastError[port] = error;
-          if(speed_f < BrickPi.MotorDead[port] && speed_f > -BrickPi.MotorDead[port]){
-            speed_f = 0;
-          }
-          if(speed_f > 0){
-            speed_f += BrickPi.MotorDead[port];
-          }else if(speed_f < 0){
-            speed_f -= BrickPi.MotorDead[port];
-          }
-          speed = Clip(speed_f, -255, 255); // Clip the speed to the range of -255 to 255.
-/*#ifdef DEBUG
-          printf("Speed: %d\n", speed);        
-#endif*/
-        }
-        
-        dir = 0;
-        if(speed < 0){
-          dir = 1;
-          speed *= (-1);
-        }
-        if(speed > 255){
-          speed = 255;
-        }
-        AddBits(1, 0, 10, ((((speed & 0xFF) << 2) | (dir << 1) | (0x01)) & 0x3FF));
+    BrickPiStopLatency[i] = 0;
+    i++;
+  }
+  
+  BrickPiEmergencyStopBroadcast();
+  BrickPiStopSent = (CurrentTickUs() - Start);
+  
+#ifdef BRICKPI_UPDATE_THREAD
+  if(BrickPiThreadRun && !pthread_equal(pthread_self(), BrickPiThread)){
+    while(BrickPiThreadBusy){                       // Don't flush or read the rx bytes until the thread has let go of the UART
+      if((CurrentTickUs() - Start) >= BrickPiStopTimeout){
+        BrickPiTxFrame(0, 1, Stop);
+        return -1;
       }
-      ii++;
+      usleep(100);
     }
-    
-    ii = 0;
-    while(ii < 2){
-      unsigned char port = (i * 2) + ii;
-      if(BrickPi.SensorType[port] == TYPE_SENSOR_I2C
-      || BrickPi.SensorType[port] == TYPE_SENSOR_I2C_9V){
-        unsigned char device = 0;
-        while(device < BrickPi.SensorI2CDevices[port]){
-          if(!(BrickPi.SensorSettings[port][device] & BIT_I2C_SAME)){
-            AddBits(1, 0, 4, BrickPi.SensorI2CWrite[port][device]);
-            AddBits(1, 0, 4, BrickPi.SensorI2CRead [port][device]);
-            unsigned char out_byte = 0;
-            while(out_byte < BrickPi.SensorI2CWrite[port][device]){
-              AddBits(1, 0, 8, BrickPi.SensorI2COut[port][device][out_byte]);
-              out_byte++;
-            }
-          }
-          device++;
+  }
+#endif
+  
+  i = 0;
+  while(i < (NUMBER_OF_BRICKPIS * 2)){
+    while(!BrickPiStopLatency[i]){
+      long Remaining = (BrickPiStopTimeout - (CurrentTickUs() - Start));
+      if(Remaining <= 0)
+        break;
+      BrickPiTx(BrickPi.Address[i], 1, Stop);
+      unsigned long Sent = CurrentTickUs();
+      long Elapsed = 0;
+      while(Elapsed < Min(5000, Remaining)){        // Skip any reply to the interrupted update
+        int Rx = BrickPiRx(&Bytes, Reply, (Min(5000, Remaining) - Elapsed));
+        if(Rx == 0 && Bytes == 1 && Reply[BYTE_MSG_TYPE] == MSG_TYPE_E_STOP){
+          BrickPiStopLatency[i] = Max((CurrentTickUs() - Start), 1);
+          break;
         }
+        if(Rx && Rx != -5)                          // Timed out, so send it again
+          break;
+        Elapsed = (CurrentTickUs() - Sent);
       }
-      ii++;
-    }
-    
-    unsigned char UART_TX_BYTES = (((Bit_Offset + 7) / 8) + 1);
-    BrickPiTx(BrickPi.Address[i], UART_TX_BYTES, Array);
-    usleep(500);
-    int result = BrickPiRx(&BytesReceived, Array, 25000);
-    
-    if(result != -2){                            // -2 is the only error that indicates that the BrickPi uC did not properly receive the message
-      BrickPi.EncoderOffset[((i * 2) + PORT_A)] = 0;
-      BrickPi.EncoderOffset[((i * 2) + PORT_B)] = 0;
     }
-    
-    if(result || (Array[BYTE_MSG_TYPE] != MSG_TYPE_VALUES)){
-#ifdef DEBUG
-      printf("BrickPiRx error: %d\n", result);
-#endif
-      if(Retried < 4){
-        Retried++;
-        goto __RETRY_COMMUNICATION__;
-      }
-      else{
+    if(!BrickPiStopLatency[i]){
 #ifdef DEBUG
-        printf("Retry failed.\n");
+      printf("No E Stop reply from address %d\n", BrickPi.Address[i]);
 #endif
-        return -1;
-      }      
-    }
-    
-    Bit_Offset = 0;
-    
-    unsigned char Temp_BitsUsed[2] = {0, 0};         // Used for encoder values
-    Temp_BitsUsed[0] = GetBits(1, 0, 5);
-    Temp_BitsUsed[1] = GetBits(1, 0, 5);
-    unsigned long Temp_EncoderVal;
-    
-    ii = 0;
-    while(ii < 2){
-      unsigned char port = ii + (i * 2);
-      Temp_EncoderVal = GetBits(1, 0, Temp_BitsUsed[ii]);
-      if(Temp_EncoderVal & 0x01){
-        Temp_EncoderVal /= 2;
-        BrickPi.Encoder[port] = Temp_EncoderVal * (-1);}
-      else{
-        BrickPi.Encoder[port] = (Temp_EncoderVal / 2);}
-      ii++;
+      result = -1;
     }
-
-    ii = 0;
-    while(ii < 2){
-      unsigned char port = ii + (i * 2);
-      switch(BrickPi.SensorType[port]){
-        case TYPE_SENSOR_TOUCH:
-          BrickPi.Sensor[port] = GetBits(1, 0, 1);
-        break;
-        case TYPE_SENSOR_ULTRASONIC_CONT:
-        case TYPE_SENSOR_ULTRASONIC_SS:
-          BrickPi.Sensor[port] = GetBits(1, 0, 8);
-        break;
-        case TYPE_SENSOR_COLOR_FULL:
-          BrickPi.Sensor[port] = GetBits(1, 0, 3);
-          BrickPi.SensorArray[port][INDEX_BLANK] = GetBits(1, 0, 10);
-          BrickPi.SensorArray[port][INDEX_RED  ] = GetBits(1, 0, 10);                
-          BrickPi.SensorArray[port][INDEX_GREEN] = GetBits(1, 0, 10);
-          BrickPi.SensorArray[port][INDEX_BLUE ] = GetBits(1, 0, 10);
-        break;          
-        case TYPE_SENSOR_I2C:
-        case TYPE_SENSOR_I2C_9V:
-          BrickPi.Sensor[port] = GetBits(1, 0, BrickPi.SensorI2CDevices[port]);
-          unsigned char device = 0;
-          while(device < BrickPi.SensorI2CDevices[port]){
-            if(BrickPi.Sensor[port] & (0x01 << device)){
-              unsigned char in_byte = 0;
-              while(in_byte < BrickPi.SensorI2CRead[port][device]){
-                BrickPi.SensorI2CIn[port][device][in_byte] = GetBits(1, 0, 8);
-                in_byte++;
-              }
-            }
-            device++;
-          }
-        break;      
-        case TYPE_SENSOR_LIGHT_OFF:
-        case TYPE_SENSOR_LIGHT_ON:
-        case TYPE_SENSOR_RCX_LIGHT:
-        case TYPE_SENSOR_COLOR_RED:
-        case TYPE_SENSOR_COLOR_GREEN:
-        case TYPE_SENSOR_COLOR_BLUE:
-        case TYPE_SENSOR_COLOR_NONE:
-        default:
-          BrickPi.Sensor[(ii + (i * 2))] = GetBits(1, 0, 10);
-      }        
-      ii++;
-    }      
     i++;
-  }       
-  return 0;
+  }
+  
+  if(result)
+    BrickPiTx(0, 1, Stop);
+  return result;
 }
 
 int I2C_file_descriptor = -1;
@@ -645,6 +1759,8 @@ int BrickPiSetLed(unsigned char led, int value){
 
 // Update the LEDs
 void BrickPiUpdateLEDs(){
+  if(SW_HOST == HOST_SIM)                        // The simulator doesn't have LEDs
+    return;
 #if COMPILE_HOST == HOST_RPI
   pwmWrite    (1,  BrickPi.LED[LED_1]     );     // Set the PWM of LED 1 (0-1023)
   digitalWrite(2, (BrickPi.LED[LED_2]?1:0));     // Set the state of LED 2
@@ -676,11 +1792,12 @@ void BrickPiExitSafely(int sig)                  // Exit the program safely
 #ifdef DEBUG
   printf("\nReceived exit signal %d\n", sig);    // Tell the user why the program is exiting
 #endif
-  BrickPiEmergencyStop();                        // Send E Stop to the BrickPi
+  BrickPiEmergencyStopBroadcast();               // Send E Stop to the BrickPi. Only the broadcast, since the signal could have interrupted an update.
   
   close(I2C_file_descriptor);
   I2C_file_descriptor = -1;
   
+  if(SW_HOST != HOST_SIM){                       // The simulator doesn't have LEDs
 #if COMPILE_HOST == HOST_RPI
   pwmWrite    (1, 0);                            // Set the PWM of LED 1 to 0
   digitalWrite(2, 0);                            // Set the state of LED 2 to 0
@@ -710,6 +1827,7 @@ void BrickPiExitSafely(int sig)                  // Exit the program safely
     system("echo 51 > /sys/class/gpio/unexport");            // Unexport the GPIO
   }  
 #endif
+  }
   close(UART_file_descriptor);                   // Close the UART port
   UART_file_descriptor = -1;
   
@@ -785,8 +1903,6 @@ long BaudCompute(unsigned long baud){
   }
 }
 
-unsigned long BaudRate;
-
 // Configure the local UART
 int UART_Configure(unsigned long baud){
   long result = BaudCompute(baud);
@@ -815,7 +1931,7 @@ int UART_Configure(unsigned long baud){
   options.c_oflag &= ~OPOST;
 
   options.c_cc [VMIN]  =  0;
-  options.c_cc [VTIME] = 10; // One second (10 deciseconds) // MT was 100
+  options.c_cc [VTIME] =  0; // read() returns immediately with whatever is available. Waiting is done with pselect() in BrickPiRxWait.
 
   tcsetattr (UART_file_descriptor, TCSANOW | TCSAFLUSH, &options);
 
@@ -977,6 +2093,15 @@ int Enable_i2c_1(){
 
 // Determine the SW host. If it's RPI, then also enable i2c if necessary (every time it boots). If it's BBB, then also enable ttyO4 and i2c-1 if necessary (every time it boots).
 int Get_SW_HOST(){
+  // Use the BrickPi Simulator if BRICKPI_UART is set
+  if(getenv("BRICKPI_UART")){
+    SW_HOST = HOST_SIM;
+    #ifdef DEBUG
+      printf("SW_HOST = HOST_SIM (%s)\n", getenv("BRICKPI_UART"));
+    #endif
+    return 0;
+  }
+
   // Determine SW_HOST
   #if ((COMPILE_HOST == HOST_RPI) || (COMPILE_HOST == HOST_BBB))
     SW_HOST = COMPILE_HOST;
@@ -1072,6 +2197,9 @@ int Get_SW_HOST(){
 }
 
 int BrickPiSetupLEDs(){
+  if(SW_HOST == HOST_SIM)                                         // The simulator doesn't have LEDs
+    return 0;
+  
   // Setup the LED GPIOs based on the COMPILE_HOST or SW_HOST
   #if COMPILE_HOST == HOST_RPI
     if(wiringPiSetup() == -1)                                     // If wiringPiSetup failed
@@ -1140,7 +2268,9 @@ int BrickPiSetupI2C(unsigned long speed){
   }  
   
   // Setup the HW I2C based on the SW_HOST
-  if(SW_HOST == HOST_RPI){
+  if(SW_HOST == HOST_SIM){                         // The simulator doesn't have HW I2C
+    return 0;
+  }else if(SW_HOST == HOST_RPI){
     if(speed < 5000)
       speed = 5000;
     if(speed > 1000000)
@@ -1180,6 +2310,9 @@ int BrickPiOpenUART(){
     UART_file_descriptor = open ("/dev/ttyO4", O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK);
 //    UART_file_descriptor = open ("/dev/ttyUSB0", O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK);
     BAUD_IDEAL = 115200;
+  }else if(SW_HOST == HOST_SIM){
+    UART_file_descriptor = open (getenv("BRICKPI_UART"), O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK);
+    BAUD_IDEAL = 500000;
   }  
   
   // If it failed to open the UART port
@@ -1189,7 +2322,27 @@ int BrickPiOpenUART(){
   return 0;
 }
 
+// The baud rate that the BrickPi was last set to, from BrickPiBaudCache, or 0 if it isn't known
+unsigned long BrickPiBaudCached(){
+  if(BrickPiBaudCache == NULL)
+    return 0;
+  FILE *file = fopen(BrickPiBaudCache, "r");
+  if(file == NULL)
+    return 0;
+  unsigned long baud = 0;
+  if(fscanf(file, "%lu", &baud) != 1 || BaudCompute(baud) == -1)
+    baud = 0;
+  fclose(file);
+  return baud;
+}
+
 int BrickPiConfigBaud(){
+  // Try the baud rate that the BrickPi was last set to first. The BrickPi FW starts with it after a reset, so this is usually
+  // BAUD_IDEAL, which the first attempt below tries.
+  unsigned long cached = BrickPiBaudCached();
+  if(cached && cached != BAUD_IDEAL && !BrickPiSetBaud(cached, BAUD_IDEAL))
+    return 0;
+  
   // Set the UART Baud rate to BAUD_IDEAL
   unsigned char i = 0;
   while(i < 5){    
@@ -1257,8 +2410,11 @@ int BrickPiSetup(){
   int i = 0;
   while(i < (NUMBER_OF_BRICKPIS * 4)){
     BrickPi.MotorTargetKP[i] = MOTOR_KP_DEFAULT;           // Set to default
+    BrickPi.MotorTargetKI[i] = MOTOR_KI_DEFAULT;           //      ''
     BrickPi.MotorTargetKD[i] = MOTOR_KD_DEFAULT;           //      ''
     BrickPi.MotorDead    [i] = MOTOR_DEAD_DEFAULT;         //      ''
+    BrickPi.MotorSpeedKP [i] = MOTOR_SPEED_KP_DEFAULT;     //      ''
+    BrickPi.MotorSpeedKI [i] = MOTOR_SPEED_KI_DEFAULT;     //      ''
     i++;
   }
   return 0;                                                // return 0
@@ -1300,7 +2456,15 @@ int BrickPiSetupAddress(unsigned char OldAddr, unsigned char NewAddr){
 }
 
 // Send an array of data to the BrickPi. Trash any rx bytes, transmit the message, and wait until is is sent.
+// tcdrain returns once the last byte has left the UART, so the reply can be received right away.
 void BrickPiTx(unsigned char dest, unsigned char ByteCount, unsigned char OutArray[]){
+  BrickPiRxFlush();
+  BrickPiTxFrame(dest, ByteCount, OutArray);
+}
+
+// Transmit the message, without touching the rx bytes. It's written with one write(), so it can't be mixed up with a message
+// that another thread is writing, and write() and tcdrain() are safe to call from a signal handler.
+void BrickPiTxFrame(unsigned char dest, unsigned char ByteCount, unsigned char OutArray[]){
   unsigned char tx_buffer[256];
   tx_buffer[0] = dest;
   tx_buffer[1] = dest + ByteCount;
@@ -1313,9 +2477,8 @@ void BrickPiTx(unsigned char dest, unsigned char ByteCount, unsigned char OutArr
   }  
   ByteCount += 3;  
 //  BrickPiSetLed(LED_1, 1);  
-  BrickPiRxFlush();
   write(UART_file_descriptor, tx_buffer, ByteCount);  
-  usleep((((1000000 * 10) / BaudRate) * ByteCount));  
+  tcdrain(UART_file_descriptor);
 //  BrickPiSetLed(LED_1, 0);
 }
 
@@ -1327,76 +2490,131 @@ int BrickPiRxBytes(){
   return result;
 }
 
-// Trash any data in the Rx buffer
-int BrickPiRxFlush(){
+#define RX_FRAME_MAX 257                          // 2 header bytes (CHECKSUM, BYTE_COUNT) + up to 255 data bytes
+
+unsigned char RxFrame[RX_FRAME_MAX * 2];          // Bytes received, but not yet returned by BrickPiRx. Can hold a complete frame plus the start of the next one.
+unsigned int  RxFrameBytes = 0;                   // How many bytes are in RxFrame
+
+// Move any bytes waiting in the UART into RxFrame. Returns how many bytes were added, or -1.
+int BrickPiRxFill(){
   int result = BrickPiRxBytes();
-  if(result > 255)
-    result = 255;
   if(result == -1)
     return -1;
-  
-  while(result){
-    unsigned char rx_trash_buffer[256];
-    read(UART_file_descriptor, rx_trash_buffer, result);
-    result = BrickPiRxBytes();
-    if(result == -1)
-      return -1;
-    if(result > 255)
-      result = 255;
-  }
-  return 0;
+  if((unsigned int)result > (sizeof(RxFrame) - RxFrameBytes))
+    result = (sizeof(RxFrame) - RxFrameBytes);
+  if(result == 0)
+    return 0;
+  result = read(UART_file_descriptor, &RxFrame[RxFrameBytes], result);
+  if(result == -1)
+    return -1;
+  RxFillUs = CurrentTickUs();
+  if(RxFrameBytes == 0)
+    RxStartUs = RxFillUs;
+  RxFrameBytes += result;
+  return result;
 }
 
-// Receive a UART message
-int BrickPiRx(unsigned char *InBytes, unsigned char *InArray, long timeout){  // timeout in uS, not mS
-  unsigned char rx_buffer[256];
-  unsigned char RxBytes = 0;
-  unsigned char CheckSum = 0;
-  unsigned char i = 0;
-  int result;
-  unsigned long OrigionalTick = CurrentTickUs();
+// Remove the first "bytes" bytes from RxFrame, keeping anything received after them
+void BrickPiRxConsume(unsigned int bytes){
+  if(bytes > RxFrameBytes)
+    bytes = RxFrameBytes;
+  RxFrameBytes -= bytes;
+  memmove(RxFrame, &RxFrame[bytes], RxFrameBytes);
+  RxStartUs = RxFillUs;                        // The next message (if it has started) arrived no later than this
+}
 
-  result = BrickPiRxBytes();
-  while(result == 0){
-    if(timeout && ((CurrentTickUs() - OrigionalTick) >= timeout))return -2;
-    usleep(100);
-    result = BrickPiRxBytes();    
-  }
-  
-  if(result == -1)return -1;
-  
-  RxBytes = 0;
-  while(RxBytes < result){                       // If it's been <<<2 times a single byte time>>> since the last data was received, assume it's the end of the message.
-    RxBytes = result;
-    usleep((((1000000 * 10) / BaudRate) * 2));
-    result = BrickPiRxBytes();
-    if(result == -1)return -1;
-  }
+// Trash any data in the Rx buffer
+int BrickPiRxFlush(){
+  RxFrameBytes = 0;
+  if(tcflush(UART_file_descriptor, TCIFLUSH) == -1)
+    return -1;
+  return 0;
+}
 
-  if (read(UART_file_descriptor, rx_buffer, RxBytes) != RxBytes)
+// Wait until there are bytes to read, or until timeout uS have passed. 0 waits forever.
+// Returns:
+//   -1 error
+//    0 timed out
+//    1 bytes are ready to be read
+int BrickPiRxWait(long timeout){
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(UART_file_descriptor, &fds);
+  struct timespec wait;
+  wait.tv_sec = (timeout / 1000000);
+  wait.tv_nsec = ((timeout % 1000000) * 1000);   // To the uS, so that a deadline less than a mS away doesn't wait too long
+  int result = pselect((UART_file_descriptor + 1), &fds, NULL, NULL, (timeout ? &wait : NULL), NULL);
+  if(result == -1)
+    return ((errno == EINTR) ? 0 : -1);        // A signal isn't an error. Let the caller check the time and wait again.
+  return (result ? 1 : 0);
+}
+
+// Move any bytes waiting in the UART into RxFrame, without waiting. Returns 1 if RxFrame holds a complete message, 0 if not, or -1.
+int BrickPiRxReady(){
+  if(BrickPiRxFill() == -1)
     return -1;
+  return (RxFrameBytes >= 2 && RxFrameBytes >= (unsigned int)(RxFrame[1] + 2));
+}
 
-  if(RxBytes < 2)
-    return -4;
-  
-  if(RxBytes < (rx_buffer[1] + 2))
-    return -6;
-  
-  CheckSum = rx_buffer[1];
+// Give up waiting for the rest of the message. Returns the BrickPiRx error for how much of it arrived.
+int BrickPiRxTimeout(){
+  int result;
+  if(RxFrameBytes == 0)
+    return -2;
+  if(RxFrameBytes < 2)
+    result = -4;
+  else
+    result = -6;
+  RxFrameBytes = 0;                            // Trash the partial message, so that the next one starts clean
+  return result;
+}
+
+// Take the complete message from the start of RxFrame. Only call this once BrickPiRxReady has returned 1.
+int BrickPiRxTake(unsigned char *InBytes, unsigned char *InArray){
+  unsigned char CheckSum = RxFrame[1];
+  unsigned char i = 0;
+  int result;
   
-  i = 0;
-  while(i < (RxBytes - 2)){
-    CheckSum += rx_buffer[i + 2];
-    InArray[i] = rx_buffer[i + 2];
+  while(i < RxFrame[1]){
+    CheckSum += RxFrame[i + 2];
+    InArray[i] = RxFrame[i + 2];
     i++;
   }
   
-  if(CheckSum != rx_buffer[0])
+  result = RxFrame[1];
+  RxTakenStartUs = RxStartUs;
+  RxTakenEndUs = RxFillUs;
+  
+  if(CheckSum != RxFrame[0]){
+    BrickPiRxConsume(result + 2);
     return -5;
+  }
   
-  *InBytes = (RxBytes - 2);
+  *InBytes = result;
+  BrickPiRxConsume(result + 2);
 
   return 0;  
 }
 
+// Receive a UART message
+// The message is complete as soon as the 2 header bytes and BYTE_COUNT data bytes have arrived. Bytes received after the end of the message are kept for the next call.
+int BrickPiRx(unsigned char *InBytes, unsigned char *InArray, long timeout){  // timeout in uS, not mS
+  int result;
+  unsigned long OrigionalTick = CurrentTickUs();
+
+  while(!(result = BrickPiRxReady())){
+    long Elapsed = (CurrentTickUs() - OrigionalTick);
+    if(timeout && (Elapsed >= timeout))
+      return BrickPiRxTimeout();
+    if(BrickPiRxWaitMode == RX_WAIT_POLL){
+      if(BrickPiRxWait(timeout ? (timeout - Elapsed) : 0) == -1)return -1;
+    }else{
+      usleep(100);
+    }
+  }
+  if(result == -1)return -1;
+  
+  return BrickPiRxTake(InBytes, InArray);
+}
+
 #endif
\ No newline at end of file
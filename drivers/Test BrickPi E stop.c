@@ -0,0 +1,117 @@
+/*
+*  You may use this code as you wish, provided you give credit where it's due.
+*
+*  This is a program for measuring the stop latency of BrickPiEmergencyStop. The update thread drives the motors, and
+*  BrickPiEmergencyStop is called from the application at a random point in the update cycle, once the encoders show that
+*  every motor is running. It exits with 1 if any stop wasn't acknowledged by every uC, or the motors weren't running.
+*  It works with a BrickPi, or without one using the BrickPi Simulator:
+*    ./simulator -l /tmp/BrickPi &
+*    BRICKPI_UART=/tmp/BrickPi ./program
+*/
+
+#define BRICKPI_UPDATE_THREAD
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "tick.h"
+
+#include "BrickPi.h"
+
+// gcc -o program "Test BrickPi E stop.c" -lrt -lm -lpthread
+// ./program [stops]
+
+#define STOPS_DEFAULT 100
+
+int result;
+
+struct BrickPiCommandStruct Command;
+struct BrickPiStruct Values;
+
+int main(int argc, char *argv[]) {
+  int stops = ((argc > 1) ? atoi(argv[1]) : STOPS_DEFAULT);
+
+  ClearTick();
+
+  BrickPi.Address[0] = 1;
+  BrickPi.Address[1] = 2;
+
+  BrickPi.Timeout = 500;
+
+  result = BrickPiSetup();
+  printf("BrickPiSetup: %d\n", result);
+  if(result)
+    return 1;
+
+  BrickPi.SensorType[PORT_1] = TYPE_SENSOR_TOUCH;
+  BrickPi.SensorType[PORT_2] = TYPE_SENSOR_ULTRASONIC_CONT;
+
+  result = BrickPiSetupSensors();
+  printf("BrickPiSetupSensors: %d\n", result);
+  if(result)
+    return 1;
+
+  printf("Baud rate %lu, %d stops\n", BaudRate, stops);
+
+  unsigned long SentMax = 0;
+  unsigned long Min = 0xFFFFFFFF;
+  unsigned long Max = 0;
+  double Sum = 0;
+  int Acks = 0;
+  int Failed = 0;
+  int NotRunning = 0;
+  long Start[NUMBER_OF_BRICKPIS * 4];
+  int s = 0;
+  while(s < stops){
+    memset(&Command, 0, sizeof(Command));
+    int port = 0;
+    while(port < (NUMBER_OF_BRICKPIS * 4)){
+      Command.MotorEnable[port] = 1;
+      Command.MotorSpeed[port] = 200;
+      port++;
+    }
+    BrickPiSetCommand(&Command);             // Staged before the thread starts, so its first update applies it
+    BrickPiStopped = 0;
+    if(BrickPiStartUpdateThread(10000, 0)){
+      printf("BrickPiStartUpdateThread failed\n");
+      return 1;
+    }
+    BrickPiGetValues(&Values);               // The encoders before the thread's first update
+    memcpy(Start, Values.Encoder, sizeof(Start));
+    usleep(20000 + (rand() % 10000));        // A couple of updates, then somewhere in the next update cycle
+    
+    BrickPiGetValues(&Values);
+    port = 0;
+    while(port < (NUMBER_OF_BRICKPIS * 4) && Values.Encoder[port] != Start[port])
+      port++;
+    if(port < (NUMBER_OF_BRICKPIS * 4))      // A motor hadn't moved, so this stop doesn't show anything
+      NotRunning++;
+
+    if(BrickPiEmergencyStop())
+      Failed++;
+    BrickPiStopUpdateThread();
+
+    if(BrickPiStopSent > SentMax)SentMax = BrickPiStopSent;
+    int i = 0;
+    while(i < (NUMBER_OF_BRICKPIS * 2)){
+      unsigned long Latency = BrickPiStopLatency[i];
+      if(Latency){
+        if(Latency < Min)Min = Latency;
+        if(Latency > Max)Max = Latency;
+        Sum += Latency;
+        Acks++;
+      }
+      i++;
+    }
+    s++;
+  }
+
+  printf("Broadcast sent within %lu uS\n", SentMax);
+  if(Acks)
+    printf("Acknowledged  min %5lu  mean %7.1f  max %6lu uS\n", Min, (Sum / Acks), Max);
+  printf("%d of %d stops not acknowledged by every uC\n", Failed, stops);
+  printf("%d of %d stops with a motor that wasn't running\n", NotRunning, stops);
+  return ((Failed || NotRunning) ? 1 : 0);
+}
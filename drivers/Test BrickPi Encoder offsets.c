@@ -0,0 +1,120 @@
+/*
+*  You may use this code as you wish, provided you give credit where it's due.
+*
+*  This is a program for checking that every encoder offset is applied exactly once, even when replies are lost and the updates
+*  are retried. The motors are floated, so the encoders only change by the offsets. Each update adds to the offsets, with
+*  MSG_TYPE_VALUES and then MSG_TYPE_VALUES_ALL, and at the end each encoder should have moved by exactly the total.
+*  It works with a BrickPi, or without one using the BrickPi Simulator, losing every 3rd reply:
+*    ./simulator -l /tmp/BrickPi -r 3 &
+*    BRICKPI_UART=/tmp/BrickPi ./program
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "tick.h"
+
+#include "BrickPi.h"
+
+// gcc -o program "Test BrickPi Encoder offsets.c" -lrt -lm
+// ./program [updates]
+
+#define UPDATES_DEFAULT 500
+
+int result;
+
+long Start[NUMBER_OF_BRICKPIS * 4];
+long Total[NUMBER_OF_BRICKPIS * 4];
+
+int main(int argc, char *argv[]) {
+  int updates = ((argc > 1) ? atoi(argv[1]) : UPDATES_DEFAULT);
+
+  ClearTick();
+
+  BrickPi.Address[0] = 1;
+  BrickPi.Address[1] = 2;
+
+  BrickPi.Timeout = 500;
+
+  result = BrickPiSetup();
+  printf("BrickPiSetup: %d\n", result);
+  if(result)
+    return 1;
+
+  BrickPi.SensorType[PORT_1] = TYPE_SENSOR_TOUCH;
+  BrickPi.SensorType[PORT_2] = TYPE_SENSOR_TOUCH;
+  BrickPi.SensorType[PORT_3] = TYPE_SENSOR_TOUCH;
+  BrickPi.SensorType[PORT_4] = TYPE_SENSOR_TOUCH;
+
+  result = BrickPiSetupSensors();
+  printf("BrickPiSetupSensors: %d\n", result);
+  if(result)
+    return 1;
+
+  while(BrickPiUpdateValues());              // The starting values
+  int port = 0;
+  while(port < (NUMBER_OF_BRICKPIS * 4)){
+    Start[port] = BrickPi.Encoder[port];
+    port++;
+  }
+
+  int i = 0;
+  while(i < (NUMBER_OF_BRICKPIS * 2)){
+    BrickPiGetFWStats(i, 1);                 // Clear the FW's counters
+    i++;
+  }
+  BrickPiStatsReset();
+
+  int Errors = 0;
+  int u = 0;
+  while(u < updates){
+    BrickPiValuesAll = (u >= (updates / 2));
+    port = 0;
+    while(port < (NUMBER_OF_BRICKPIS * 4)){
+      long Offset = ((port + 1) * ((u % 7) - 3));
+      BrickPi.EncoderOffset[port] += Offset;
+      Total[port] += Offset;
+      port++;
+    }
+    if(BrickPiUpdateValues())
+      Errors++;
+    u++;
+  }
+
+  // Until the last offsets have been sent
+  u = 0;
+  int Pending = 1;
+  while(Pending && u < 100){
+    BrickPiUpdateValues();
+    Pending = 0;
+    port = 0;
+    while(port < (NUMBER_OF_BRICKPIS * 4)){
+      if(BrickPi.EncoderOffset[port])
+        Pending = 1;
+      port++;
+    }
+    u++;
+  }
+
+  printf("%d updates, %d with errors\n", updates, Errors);
+  int Wrong = 0;
+  port = 0;
+  while(port < (NUMBER_OF_BRICKPIS * 4)){
+    long Moved = (Start[port] - BrickPi.Encoder[port]);
+    printf("Encoder %d  offsets %6ld  moved %6ld%s\n", port, Total[port], Moved, ((Moved == Total[port]) ? "" : "  WRONG"));
+    if(Moved != Total[port])
+      Wrong++;
+    port++;
+  }
+
+  i = 0;
+  while(i < (NUMBER_OF_BRICKPIS * 2)){
+    BrickPiGetFWStats(i, 0);
+    i++;
+  }
+  BrickPiStatsPrint(stdout);
+  printf("%s\n", (Wrong ? "Some offsets were lost or applied twice" : "Every offset was applied once"));
+  return (Wrong ? 1 : 0);
+}
@@ -0,0 +1,99 @@
+/*
+*  You may use this code as you wish, provided you give credit where it's due.
+*
+*  This is a program for checking that one BrickPi uC that has stopped answering doesn't stall the others. After the setup, the
+*  second uC's address is changed to one that nothing answers to. Then it updates for a few seconds, and prints how often each
+*  uC was updated, failed or skipped, and the update latency.
+*  It works with a BrickPi, or without one using the BrickPi Simulator:
+*    ./simulator -l /tmp/BrickPi &
+*    BRICKPI_UART=/tmp/BrickPi ./program
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "tick.h"
+
+#include "BrickPi.h"
+
+// gcc -o program "Test BrickPi Health.c" -lrt -lm
+// ./program [seconds]
+
+#define SECONDS_DEFAULT 5
+
+int result;
+
+int main(int argc, char *argv[]) {
+  int seconds = ((argc > 1) ? atoi(argv[1]) : SECONDS_DEFAULT);
+
+  ClearTick();
+
+  BrickPi.Address[0] = 1;
+  BrickPi.Address[1] = 2;
+
+  BrickPi.Timeout = 500;
+
+  result = BrickPiSetup();
+  printf("BrickPiSetup: %d\n", result);
+  if(result)
+    return 1;
+
+  BrickPi.Address[1] = 3;                    // The second uC "stops answering"
+
+  BrickPi.MotorEnable[PORT_A] = 1;
+  BrickPi.MotorEnable[PORT_B] = 1;
+  BrickPi.MotorSpeed[PORT_A] = 100;
+  BrickPi.MotorSpeed[PORT_B] = 100;
+
+  unsigned long Updated[NUMBER_OF_BRICKPIS * 2] = {0};
+  unsigned long Failed [NUMBER_OF_BRICKPIS * 2] = {0};
+  unsigned long Skipped[NUMBER_OF_BRICKPIS * 2] = {0};
+  unsigned long Latency[4096];
+  int Updates = 0;
+  unsigned long Start = CurrentTickUs();
+  while((CurrentTickUs() - Start) < (seconds * 1000000UL)){
+    unsigned long Tick = CurrentTickUs();
+    BrickPiUpdateValues();
+    if(Updates < 4096)
+      Latency[Updates] = (CurrentTickUs() - Tick);
+    Updates++;
+    int i = 0;
+    while(i < (NUMBER_OF_BRICKPIS * 2)){
+      if(BrickPiControllerResult[i] == CONTROLLER_UPDATED)Updated[i]++;
+      if(BrickPiControllerResult[i] == CONTROLLER_FAILED) Failed[i]++;
+      if(BrickPiControllerResult[i] == CONTROLLER_SKIPPED)Skipped[i]++;
+      i++;
+    }
+    usleep(10000);
+  }
+
+  printf("%d updates in %d s\n", Updates, seconds);
+  int i = 0;
+  while(i < (NUMBER_OF_BRICKPIS * 2)){
+    printf("Address %d  updated %5lu  failed %5lu  skipped %5lu  failures in a row %lu\n", BrickPi.Address[i], Updated[i], Failed[i], Skipped[i], BrickPiHealth[i].Failures);
+    i++;
+  }
+
+  // Sort the latencies, for the percentiles
+  int n = ((Updates < 4096) ? Updates : 4096);
+  i = 1;
+  while(i < n){
+    unsigned long v = Latency[i];
+    int ii = i;
+    while(ii && Latency[ii - 1] > v){
+      Latency[ii] = Latency[ii - 1];
+      ii--;
+    }
+    Latency[ii] = v;
+    i++;
+  }
+  if(n)
+    printf("Update latency  p50 %lu  p90 %lu  p99 %lu  max %lu uS\n", Latency[n / 2], Latency[(n * 9) / 10], Latency[(n * 99) / 100], Latency[n - 1]);
+  
+  // The first uC should have been updated every time, and the second one backed off from
+  int Healthy = (Updates && Updated[0] == (unsigned long)Updates && Skipped[1] > 0);
+  printf("%s\n", (Healthy ? "The uC that answers was updated every time" : "The uC that stopped answering held up the other one"));
+  return (Healthy ? 0 : 1);
+}
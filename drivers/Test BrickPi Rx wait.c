@@ -0,0 +1,121 @@
+/*
+*  You may use this code as you wish, provided you give credit where it's due.
+*
+*  This is a program for comparing the BrickPiRx wait methods (RX_WAIT_SPIN and RX_WAIT_POLL).
+*  It doesn't need a BrickPi. A child process sends timestamped messages through a pseudo-terminal,
+*  and the CPU time used and the wake latency of BrickPiRx are measured for each wait method.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "tick.h"
+
+#include "BrickPi.h"
+
+// gcc -o program "Test BrickPi Rx wait.c" -lrt
+// ./program
+
+#define MESSAGES      1000                   // How many messages to receive with each wait method
+#define MESSAGE_GAP   2000                   // uS between messages sent by the child
+
+int PTY_master = -1;
+
+// Monotonic time in nS. Unlike CurrentTickUs, this is the same for both processes.
+unsigned long long TimeNs(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+// Child process. Send MESSAGES messages, each carrying the time it was sent.
+void SendMessages(){
+  unsigned char tx_buffer[10];
+  int m = 0;
+  while(m < MESSAGES){
+    usleep(MESSAGE_GAP);
+    unsigned long long sent = TimeNs();
+    tx_buffer[1] = 8;
+    tx_buffer[0] = tx_buffer[1];
+    unsigned char i = 0;
+    while(i < 8){
+      tx_buffer[i + 2] = ((sent >> (i * 8)) & 0xFF);
+      tx_buffer[0] += tx_buffer[i + 2];
+      i++;
+    }
+    write(PTY_master, tx_buffer, 10);
+    m++;
+  }
+  _exit(0);                                  // Don't flush the parent's stdio buffers a second time
+}
+
+double CPUTimeMs(){
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec * 1000.0) + (usage.ru_utime.tv_usec / 1000.0)
+       + (usage.ru_stime.tv_sec * 1000.0) + (usage.ru_stime.tv_usec / 1000.0);
+}
+
+void Measure(int mode, const char *name){
+  BrickPiRxWaitMode = mode;
+  BrickPiRxFlush();
+  
+  pid_t pid = fork();
+  if(pid == 0)
+    SendMessages();
+  
+  double CPUStart = CPUTimeMs();
+  unsigned long long WallStart = TimeNs();
+  unsigned long long LatencySum = 0;
+  unsigned long long LatencyMax = 0;
+  int errors = 0;
+  int m = 0;
+  while(m < MESSAGES){
+    if(BrickPiRx(&BytesReceived, Array, 1000000) || BytesReceived != 8){
+      errors++;
+    }else{
+      unsigned long long received = TimeNs();
+      unsigned long long sent = 0;
+      int i = 8;
+      while(i){
+        i--;
+        sent = (sent << 8) | Array[i];
+      }
+      LatencySum += (received - sent);
+      if((received - sent) > LatencyMax)
+        LatencyMax = (received - sent);
+    }
+    m++;
+  }
+  double CPU = CPUTimeMs() - CPUStart;
+  double Wall = (TimeNs() - WallStart) / 1000000.0;
+  waitpid(pid, NULL, 0);
+  
+  printf("%s  CPU: %7.1f ms (%5.1f%%)  Latency avg: %6.1f uS  max: %7.1f uS  Errors: %d\n", name, CPU, ((CPU * 100) / Wall), ((LatencySum / 1000.0) / (MESSAGES - errors)), (LatencyMax / 1000.0), errors);
+}
+
+int main() {
+  ClearTick();
+  
+  PTY_master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(PTY_master == -1 || grantpt(PTY_master) || unlockpt(PTY_master)){
+    printf("Failed to open a pseudo-terminal\n");
+    return 0;
+  }
+  UART_file_descriptor = open(ptsname(PTY_master), O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK);
+  if(UART_file_descriptor == -1 || UART_Configure(500000)){
+    printf("Failed to open %s\n", ptsname(PTY_master));
+    return 0;
+  }
+  
+  printf("%d messages, one every %d uS\n", MESSAGES, MESSAGE_GAP);
+  Measure(RX_WAIT_SPIN, "RX_WAIT_SPIN");
+  Measure(RX_WAIT_POLL, "RX_WAIT_POLL");
+  return 0;
+}
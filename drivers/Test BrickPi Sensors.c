@@ -50,6 +50,7 @@ int main() {
     return 0;
 
   BrickPi.SensorType[PORT_1] = TYPE_SENSOR_LIGHT_ON;
+  BrickPi.SensorOversample[PORT_1] = 4;        // Average 16 ADC conversions, for a 12 bit value (0 - 4092)
   BrickPi.SensorType[PORT_2] = TYPE_SENSOR_TOUCH;  
   BrickPi.SensorType[PORT_3] = TYPE_SENSOR_ULTRASONIC_CONT;
   BrickPi.SensorType[PORT_4] = TYPE_SENSOR_COLOR_FULL;
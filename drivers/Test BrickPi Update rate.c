@@ -0,0 +1,105 @@
+/*
+*  You may use this code as you wish, provided you give credit where it's due.
+*
+*  This is a program for measuring the end-to-end update rate and latency of BrickPiUpdateValues.
+*  It works with a BrickPi, or without one using the BrickPi Simulator:
+*    ./simulator -l /tmp/BrickPi &
+*    BRICKPI_UART=/tmp/BrickPi ./program
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "tick.h"
+
+#include "BrickPi.h"
+
+// gcc -o program "Test BrickPi Update rate.c" -lrt -lm
+// ./program [updates]
+
+#define UPDATES_DEFAULT 1000
+
+int result;
+
+// Run "updates" updates, and print the latency of each one, the update rate, the time taken by each phase, and the FW's counters
+void Measure(const char *name, int updates){
+  unsigned long Min = 0xFFFFFFFF;
+  unsigned long Max = 0;
+  double Sum = 0;
+  double SumSq = 0;
+  int Errors = 0;
+  int i = 0;
+  while(i < (NUMBER_OF_BRICKPIS * 2)){
+    BrickPiGetFWStats(i, 1);                 // Clear the FW's counters
+    i++;
+  }
+  i = 0;
+  BrickPiStatsReset();
+  unsigned long Start = CurrentTickUs();
+  while(i < updates){
+    BrickPi.MotorSpeed[PORT_A] = ((i % 200) - 100);
+    BrickPi.MotorSpeed[PORT_B] = (100 - (i % 200));
+    unsigned long Tick = CurrentTickUs();
+    if(BrickPiUpdateValues())
+      Errors++;
+    unsigned long Latency = (CurrentTickUs() - Tick);
+    if(Latency < Min)Min = Latency;
+    if(Latency > Max)Max = Latency;
+    Sum += Latency;
+    SumSq += ((double)Latency * Latency);
+    i++;
+  }
+  unsigned long Elapsed = (CurrentTickUs() - Start);
+  double Mean = (Sum / updates);
+  printf("%-22s %8.1f updates/s  latency min %5lu  mean %7.1f  max %6lu  sd %6.1f uS  errors %d\n",
+    name, ((updates * 1000000.0) / Elapsed), Min, Mean, Max, sqrt((SumSq / updates) - (Mean * Mean)), Errors);
+  i = 0;
+  while(i < (NUMBER_OF_BRICKPIS * 2)){
+    BrickPiGetFWStats(i, 0);
+    i++;
+  }
+  BrickPiStatsPrint(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  int updates = ((argc > 1) ? atoi(argv[1]) : UPDATES_DEFAULT);
+
+  ClearTick();
+
+  BrickPi.Address[0] = 1;
+  BrickPi.Address[1] = 2;
+
+  BrickPi.Timeout = 500;
+
+  result = BrickPiSetup();
+  printf("BrickPiSetup: %d\n", result);
+  if(result)
+    return 0;
+
+  BrickPi.SensorType[PORT_1] = TYPE_SENSOR_LIGHT_ON;
+  BrickPi.SensorType[PORT_2] = TYPE_SENSOR_TOUCH;
+  BrickPi.SensorType[PORT_3] = TYPE_SENSOR_ULTRASONIC_CONT;
+  BrickPi.SensorType[PORT_4] = TYPE_SENSOR_COLOR_FULL;
+
+  BrickPi.MotorEnable[PORT_A] = 1;
+  BrickPi.MotorEnable[PORT_B] = 1;
+
+  result = BrickPiSetupSensors();
+  printf("BrickPiSetupSensors: %d\n", result);
+  if(result)
+    return 0;
+
+  printf("Baud rate %lu, %d updates\n", BaudRate, updates);
+
+  BrickPiValuesAll = 0;
+  Measure("MSG_TYPE_VALUES", updates);
+
+  BrickPiValuesAll = 1;
+  Measure("MSG_TYPE_VALUES_ALL", updates);
+
+  BrickPiValuesAll = 0;
+  BrickPiEmergencyStop();
+  return 0;
+}
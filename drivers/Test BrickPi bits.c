@@ -0,0 +1,170 @@
+/*
+*  You may use this code as you wish, provided you give credit where it's due.
+*
+*  This is a program for testing the AddBits and GetBits functions of the RPi BrickPi drivers.
+*  It doesn't need a BrickPi. It checks that they pack and unpack exactly the same bits as the
+*  original one-bit-at-a-time functions, and then times both versions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "tick.h"
+
+#include "BrickPi.h"
+
+// gcc -o program "Test BrickPi bits.c" -lrt
+// ./program
+
+#define TESTS       100000               // How many random bit streams to compare
+#define BENCH_LOOPS 100000               // How many times to pack and unpack a VALUES message for the timing
+
+// The original AddBits, one bit at a time
+void AddBitsOriginal(unsigned char byte_offset, unsigned char bit_offset, unsigned char bits, unsigned long value){
+  unsigned char i = 0;
+  while(i < bits){
+    if(value & 0x01){
+      Array[(byte_offset + ((bit_offset + Bit_Offset + i) / 8))] |= (0x01 << ((bit_offset + Bit_Offset + i) % 8));
+    }
+    value /= 2;
+    i++;
+  }
+  Bit_Offset += bits;
+}
+
+// The original GetBits, one bit at a time
+unsigned long GetBitsOriginal(unsigned char byte_offset, unsigned char bit_offset, unsigned char bits){
+  unsigned long Result = 0;
+  char i = bits;
+  while(i){
+    Result *= 2;
+    Result |= ((Array[(byte_offset + ((bit_offset + Bit_Offset + (i - 1)) / 8))] >> ((bit_offset + Bit_Offset + (i - 1)) % 8)) & 0x01);    
+    i--;
+  }
+  Bit_Offset += bits;
+  return Result;
+}
+
+unsigned char FieldBits [64];
+unsigned long FieldValue[64];
+unsigned char Expected  [256];
+
+// Pack and unpack one random bit stream with both versions. Returns 0 if they match.
+int CompareRandomStream(){
+  unsigned char byte_offset = (rand() % 4);
+  unsigned char fields = (rand() % 64);
+  int total = 0;
+  unsigned char f = 0;
+  while(f < fields){
+    FieldBits [f] = (rand() % 33);                                    // 0 to 32 bits, like the encoder values
+    if((total + FieldBits[f]) > ((256 - byte_offset - 8) * 8))
+      break;
+    FieldValue[f] = (((unsigned long)rand() << 16) ^ rand());         // Including bits above "bits", which must be ignored
+    total += FieldBits[f];
+    f++;
+  }
+  fields = f;
+  
+  memset(Array, 0, 256);
+  Bit_Offset = 0;
+  for(f = 0; f < fields; f++)
+    AddBitsOriginal(byte_offset, 0, FieldBits[f], FieldValue[f]);
+  memcpy(Expected, Array, 256);
+  
+  memset(Array, 0, 256);
+  Bit_Offset = 0;
+  for(f = 0; f < fields; f++)
+    AddBits(byte_offset, 0, FieldBits[f], FieldValue[f]);
+  if(memcmp(Expected, Array, 256)){
+    printf("AddBits mismatch\n");
+    return -1;
+  }
+  
+  unsigned int Bit_Offset_Original = 0;
+  Bit_Offset = 0;
+  for(f = 0; f < fields; f++){
+    unsigned int Bit_Offset_New = Bit_Offset;
+    Bit_Offset = Bit_Offset_Original;
+    unsigned long original = GetBitsOriginal(byte_offset, 0, FieldBits[f]);
+    Bit_Offset_Original = Bit_Offset;
+    Bit_Offset = Bit_Offset_New;
+    unsigned long value = GetBits(byte_offset, 0, FieldBits[f]);
+    if(value != original || value != (FieldBits[f] ? (FieldValue[f] & (0xFFFFFFFFUL >> (32 - FieldBits[f]))) : 0)){
+      printf("GetBits mismatch: %d bits, %lu != %lu\n", FieldBits[f], value, original);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// A VALUES message, and its reply, with encoder offsets, two motors, and an I2C port reading 16 bytes
+void PackValues(void (*Add)(unsigned char, unsigned char, unsigned char, unsigned long)){
+  memset(Array, 0, 256);
+  Bit_Offset = 0;
+  Add(1, 0, 1, 1);
+  Add(1, 0, 5, 17);
+  Add(1, 0, 18, 123456);
+  Add(1, 0, 1, 0);
+  Add(1, 0, 10, 0x3FD);
+  Add(1, 0, 10, 0x1FB);
+  Add(1, 0, 5, 22);
+  Add(1, 0, 5, 12);
+  Add(1, 0, 22, 1234567);
+  Add(1, 0, 12, 2345);
+  Add(1, 0, 1, 1);
+  int i = 0;
+  while(i < 16){
+    Add(1, 0, 8, i * 13);
+    i++;
+  }
+}
+
+unsigned long UnpackValues(unsigned long (*Get)(unsigned char, unsigned char, unsigned char)){
+  unsigned long sum = 0;
+  Bit_Offset = 0;
+  unsigned char length_a = Get(1, 0, 5);
+  unsigned char length_b = Get(1, 0, 5);
+  sum += Get(1, 0, length_a);
+  sum += Get(1, 0, length_b);
+  sum += Get(1, 0, 1);
+  int i = 0;
+  while(i < 16){
+    sum += Get(1, 0, 8);
+    i++;
+  }
+  return sum;
+}
+
+void Bench(const char *name, void (*Add)(unsigned char, unsigned char, unsigned char, unsigned long), unsigned long (*Get)(unsigned char, unsigned char, unsigned char)){
+  unsigned long sum = 0;
+  unsigned long start = CurrentTickUs();
+  int i = 0;
+  while(i < BENCH_LOOPS){
+    PackValues(Add);
+    sum += UnpackValues(Get);
+    i++;
+  }
+  unsigned long elapsed = CurrentTickUs() - start;
+  printf("%s  %8lu uS for %d messages (%.3f uS each)  checksum %lu\n", name, elapsed, BENCH_LOOPS, ((float)elapsed / BENCH_LOOPS), sum);
+}
+
+int main() {
+  ClearTick();
+  srand(1);
+  
+  int i = 0;
+  while(i < TESTS){
+    if(CompareRandomStream()){
+      printf("Failed on test %d\n", i);
+      return 1;
+    }
+    i++;
+  }
+  printf("%d random bit streams matched\n", TESTS);
+  
+  Bench("Original", AddBitsOriginal, GetBitsOriginal);
+  Bench("New     ", AddBits, GetBits);
+  return 0;
+}
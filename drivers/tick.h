@@ -27,20 +27,23 @@ int ClearTick(){
   nsec_offset = tick_struct.tv_nsec;
 }
 
+// These use a local timespec, so that they can be called from more than one thread (e.g. the BrickPi update thread).
 unsigned long CurrentTickMs(){
-  clock_gettime(CLOCK_REALTIME, &tick_struct);
-  tick_struct.tv_sec -= sec_offset;
-  tick_struct.tv_nsec -= nsec_offset;
-  tick_struct.tv_nsec /= 1000000;
-  return ((tick_struct.tv_sec * 1000) + tick_struct.tv_nsec);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  now.tv_sec -= sec_offset;
+  now.tv_nsec -= nsec_offset;
+  now.tv_nsec /= 1000000;
+  return ((now.tv_sec * 1000) + now.tv_nsec);
 }
 
 unsigned long CurrentTickUs(){
-  clock_gettime(CLOCK_REALTIME, &tick_struct);
-  tick_struct.tv_sec -= sec_offset;
-  tick_struct.tv_nsec -= nsec_offset;
-  tick_struct.tv_nsec /= 1000;
-  return ((tick_struct.tv_sec * 1000000) + tick_struct.tv_nsec);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  now.tv_sec -= sec_offset;
+  now.tv_nsec -= nsec_offset;
+  now.tv_nsec /= 1000;
+  return ((now.tv_sec * 1000000) + now.tv_nsec);
 }
 
 #endif
\ No newline at end of file
@@ -26,22 +26,127 @@ uint8_t A_Setup(){
   
   A_Config(PORT_1, 0);
   A_Config(PORT_2, 0);
+  return 1;
 }
 
 uint16_t A_ReadRaw(uint8_t port){
   return A_ReadRawCh(port + 6);
 }
 
+volatile uint8_t  A_FreePorts;     // Bit 0 for PORT_1 and bit 1 for PORT_2, if the ADC ISR is converting it
+uint8_t           A_Oversample[2];
+uint16_t          A_Sum       [2];
+uint8_t           A_Count     [2];
+volatile uint16_t A_Value     [2];
+
+void A_FreeStart(void);
+
 uint16_t A_ReadRawCh(uint8_t channel){
   if(channel > 7)              // If it's not a valid channel
     return 0;                  //   return 0
 
-	ADMUX = (channel & 0x07);    // Specify which channel to read
+  uint8_t sreg = SREG;         // Pause the ADC ISR. The conversion it started is thrown away.
+  cli();
+  uint8_t Free = (ADCSRA & (1 << ADIE));
+  ADCSRA &= ~(1 << ADIE);
+  SREG = sreg;
+  while(ADCSRA & (1 << ADSC));
+
+  ADMUX = (channel & 0x07);    // Specify which channel to read
   ADCSRA |= (1 << ADSC);       // Begin converting
-	while(ADCSRA & (1 << ADSC)); // Wait until ADSC is cleared (the conversion is complete)
-	uint8_t low  = ADCL;         // Read ADCL first, so that SDCH gets locked
-	uint8_t high = ADCH;
-	return (high << 8) | low;    // Return the combined values of ADCL and ADCH
+  while(ADCSRA & (1 << ADSC)); // Wait until ADSC is cleared (the conversion is complete)
+  uint8_t low  = ADCL;         // Read ADCL first, so that SDCH gets locked
+  uint8_t high = ADCH;
+  
+  if(Free)
+    A_FreeStart();
+  return (high << 8) | low;    // Return the combined values of ADCL and ADCH
+}
+
+// Start converting the next port that's running free, on channel 6 or 7
+void A_FreeNext(void){
+  uint8_t port = ((ADMUX & 0x07) == 6) ? PORT_2 : PORT_1;
+  if(!(A_FreePorts & (1 << port)))
+    port ^= 1;
+  ADMUX = (port + 6);
+  ADCSRA |= (1 << ADSC);
+}
+
+// Start the ADC ISR, unless it's already running. Any conversion already finished is thrown away.
+void A_FreeStart(void){
+  uint8_t sreg = SREG;
+  cli();
+  if(A_FreePorts && !(ADCSRA & (1 << ADIE))){
+    ADCSRA |= ((1 << ADIF) | (1 << ADIE));    // Writing 1 to ADIF clears it
+    A_FreeNext();
+  }
+  SREG = sreg;
+}
+
+void A_Free(uint8_t port, uint8_t oversample){
+  if(port > PORT_2)
+    return;
+  if(oversample > A_OVERSAMPLE_MAX)
+    oversample = A_OVERSAMPLE_MAX;
+  A_FreeStop(port);
+  A_Oversample[port] = oversample;
+  A_Sum[port] = 0;
+  A_Count[port] = 0;
+  A_Value[port] = (A_ReadRaw(port) << (oversample / 2));   // So that it's valid until the first average is done
+  
+  uint8_t sreg = SREG;
+  cli();
+  A_FreePorts |= (1 << port);
+  SREG = sreg;
+  A_FreeStart();
+}
+
+void A_FreeStop(uint8_t port){
+  if(port > PORT_2)
+    return;
+  uint8_t sreg = SREG;
+  cli();
+  A_FreePorts &= ~(1 << port);
+  if(!A_FreePorts)
+    ADCSRA &= ~(1 << ADIE);                    // The conversion already started finishes without the ISR
+  SREG = sreg;
+}
+
+uint8_t A_FreeRunning(uint8_t port){
+  if(port > PORT_2)
+    return 0;
+  return (A_FreePorts >> port) & 0x01;
+}
+
+uint16_t A_ReadFree(uint8_t port){
+  if(port > PORT_2)
+    return 0;
+  uint8_t sreg = SREG;
+  cli();
+  uint16_t value = A_Value[port];
+  SREG = sreg;
+  return value;
+}
+
+// A conversion finished. Add it to its port's sum, and start the next port. 2^n conversions have n more bits than one, and
+// n / 2 of them are kept, which is as much resolution as oversampling can add.
+ISR(ADC_vect){
+  uint8_t low  = ADCL;
+  uint8_t high = ADCH;
+  uint8_t port = ((ADMUX & 0x07) - 6);
+  if(port <= PORT_2 && (A_FreePorts & (1 << port))){
+    A_Sum[port] += ((high << 8) | low);
+    A_Count[port]++;
+    if(A_Count[port] >= (1 << A_Oversample[port])){
+      A_Value[port] = (A_Sum[port] >> ((A_Oversample[port] + 1) / 2));
+      A_Sum[port] = 0;
+      A_Count[port] = 0;
+    }
+  }
+  if(A_FreePorts)
+    A_FreeNext();
+  else
+    ADCSRA &= ~(1 << ADIE);
 }
 
 uint8_t A_Config(uint8_t port, uint8_t states){
@@ -50,6 +155,7 @@ uint8_t A_Config(uint8_t port, uint8_t states){
   A_SetD0(port, (states & MASK_D0_M), (states & MASK_D0_S));
   A_SetD1(port, (states & MASK_D1_M), (states & MASK_D1_S));
   A_Set9V(port, (states & MASK_9V));
+  return 1;
 }
 
 uint8_t A_SetD0(uint8_t port, uint8_t mode, uint8_t state){
@@ -57,6 +163,7 @@ uint8_t A_SetD0(uint8_t port, uint8_t mode, uint8_t state){
   else     DDRC  &= ~(0x04 << port);   // Set PC2/PC3 as input
   if(state)PORTC |=  (0x04 << port);   // Set PC2/PC3 high
   else     PORTC &= ~(0x04 << port);   // Set PC2/PC3 low  
+  return 1;
 }
 
 uint8_t A_SetD1(uint8_t port, uint8_t mode, uint8_t state){
@@ -64,10 +171,12 @@ uint8_t A_SetD1(uint8_t port, uint8_t mode, uint8_t state){
   else     DDRC  &= ~(0x01 << port);   // Set PC2/PC3 as input
   if(state)PORTC |=  (0x01 << port);   // Set PC2/PC3 high
   else     PORTC &= ~(0x01 << port);   // Set PC2/PC3 low
+  return 1;
 }
 
 uint8_t A_Set9V(uint8_t port, uint8_t state){
   DDRD |= (0x40 << port);              // Set PD6/PD7 as output
   if(state) PORTD |=  (0x40 << port);  // Set PD6/PD7 high  
   else      PORTD &= ~(0x40 << port);  // Set PD6/PD7 low
+  return 1;
 }
\ No newline at end of file
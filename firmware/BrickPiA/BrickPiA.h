@@ -26,9 +26,15 @@
 #define MASK_D0_S 0x08
 #define MASK_D1_S 0x10
 
+#define A_OVERSAMPLE_MAX 6   // Up to 2^6 conversions averaged, for 3 extra bits
+
 uint8_t  A_Setup(void);
 uint16_t A_ReadRaw(uint8_t port);
 uint16_t A_ReadRawCh(uint8_t channel);
+void     A_Free(uint8_t port, uint8_t oversample);   // Convert the port over and over from the ADC ISR, averaging 2^oversample conversions
+void     A_FreeStop(uint8_t port);
+uint8_t  A_FreeRunning(uint8_t port);
+uint16_t A_ReadFree(uint8_t port);                   // The latest average, with (oversample / 2) extra bits. Doesn't wait.
 uint8_t  A_Config(uint8_t port, uint8_t states);
 uint8_t  A_Set9V(uint8_t port, uint8_t state);
 uint8_t  A_SetD0(uint8_t port, uint8_t mode, uint8_t state);
@@ -236,6 +236,7 @@ int CS_Calibrate()
 
   blank_val = (blank_val * 100) / (((SENSORMAX - MINBLANKVAL ) * 100) / ADMAX);
   cal_values[CS_PORT][BLANK_INDEX] = (blank_val * calData[CS_PORT][cal_tab][BLANK_INDEX]) >> 16 ; //TODO CHECK SHIFT    
+  return 0;
 }
 
 uint8_t CS_CalToColor()
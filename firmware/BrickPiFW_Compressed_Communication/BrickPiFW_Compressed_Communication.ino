@@ -28,6 +28,8 @@
       sensor 1 type 1 byte
       sensor 2 type 1 byte
         for each sensor port
+          if sensor type is raw analog (0 - 31)
+            oversampling 3 bits (average 2^n ADC conversions, 0 - 6)
           if sensor type is I2C
             speed 8 bits
             devices 3 bits
@@ -43,6 +45,8 @@
       reply MSG_TYPE_SENSOR_TYPE 1 byte
     
     if message type == MSG_TYPE_VALUES
+      sequence number 1 byte (1 - 255. If it's the same as the last one, the message isn't handled again, and the last reply is sent again.)
+      
       for ports
         if offset encoder 1 bit
           offset length 5 bits
@@ -50,6 +54,10 @@
       
       for ports
         motor control 10 bits
+        if motor control == M_CONTROL_REGULATED
+          if new target 1 bit
+            target length 5 bits
+            target (target length + 1) (encoder ticks, or ticks per second for M_REG_SPEED)
       
       for sensor ports
         if sensor port type == TYPE_SENSOR_I2C
@@ -62,6 +70,7 @@
       
       reply
         MSG_TYPE_VALUES 1 byte
+        sequence number 1 byte (the same as the message)
         
         for motor ports
           encoder length 5 bits
@@ -69,6 +78,12 @@
         for motor ports
           encoder value (encoder length)
         
+        for motor ports
+          velocity length 5 bits
+          velocity value (velocity length) (ticks per second, the same format as the encoder value)
+        
+        sample time 32 bits (micros() when the encoders were sampled)
+        
         for sensor port
           switch sensor type
             case TYPE_SENSOR_TOUCH:
@@ -92,14 +107,62 @@
                   for in_byte
                     I2C_In_Array 8 bits
             
-            case TYPE_SENSOR_LIGHT_OFF:
-            case TYPE_SENSOR_LIGHT_ON:
             case TYPE_SENSOR_RCX_LIGHT:
             case TYPE_SENSOR_COLOR_RED:
             case TYPE_SENSOR_COLOR_GREEN:
             case TYPE_SENSOR_COLOR_BLUE:
             case TYPE_SENSOR_COLOR_NONE:
               sensor value 10 bits
+            
+            default (raw analog, including TYPE_SENSOR_LIGHT_OFF and TYPE_SENSOR_LIGHT_ON):
+              sensor value (10 + (oversampling / 2)) bits
+    
+    if message type == MSG_TYPE_MOTOR_SETTINGS
+      for ports
+        regulation mode 1 byte (M_REG_NONE, M_REG_POSITION, M_REG_SPEED)
+        KP 2 bytes (8.8 fixed point)
+        KI 2 bytes
+        KD 2 bytes
+        dead band 1 byte
+      
+      reply MSG_TYPE_MOTOR_SETTINGS 1 byte
+    
+    if message type == MSG_TYPE_SENSOR_HASH
+      reply
+        MSG_TYPE_SENSOR_HASH 1 byte
+        if the sensors are set up (by MSG_TYPE_SENSOR_TYPE, or from the EEPROM at reset)
+          hash 2 bytes (low byte first, CRC-16-CCITT of the MSG_TYPE_SENSOR_TYPE message after the MSG_TYPE byte)
+    
+    if message type == MSG_TYPE_STATS
+      clear 1 byte (optional, 1 to clear the counters after replying)
+      
+      reply (all low byte first, counted since reset or since they were cleared)
+        MSG_TYPE_STATS 1 byte
+        loop() passes 4 bytes
+        addressed messages handled 4 bytes
+        uS from receiving them to queueing the reply, summed 4 bytes
+          '' the longest 4 bytes
+        for UART_ReadFrame errors -3 (not this uC's address), -4 (header cut short), -5 (checksum) and -6 (length)
+          count 2 bytes
+        for ports A and B
+          encoder ISR calls 4 bytes
+        COMM_TIMEOUT floats 2 bytes
+        for ports 1 and 2
+          for I2C devices 0 - 7
+            failed transfers 2 bytes
+      repeated MSG_TYPE_VALUES sequence numbers 2 bytes
+    
+    if message type == MSG_TYPE_VALUES_ALL (broadcast)
+      reply time slot width 1 byte (100 uS units)
+      for uCs
+        address 1 byte
+        byte count 1 byte
+        the same sequence number and bits as MSG_TYPE_VALUES (byte count bytes)
+      
+      reply (only if this uC's address was included, starting "slot number * slot width" after the message was received)
+        MSG_TYPE_VALUES_ALL 1 byte
+        address 1 byte
+        the same sequence number and bits as the MSG_TYPE_VALUES reply
 */
 
 #include "EEPROM.h"              // Arduino EEPROM library
@@ -117,6 +180,10 @@
   #define MSG_TYPE_E_STOP           4 // Float motors immidately
   #define MSG_TYPE_TIMEOUT_SETTINGS 5 // Set the timeout
   #define MSG_TYPE_BAUD_SETTINGS    6 // Set the baud rate
+  #define MSG_TYPE_VALUES_ALL       7 // Set the motors of every uC with one broadcast message. Each uC replies in its own time slot.
+  #define MSG_TYPE_MOTOR_SETTINGS   8 // Set the motor regulation mode and gains
+  #define MSG_TYPE_SENSOR_HASH      9 // Get the hash of the sensor setup, so that the RPi can skip MSG_TYPE_SENSOR_TYPE if it's the same
+  #define MSG_TYPE_STATS           10 // Get the FW's counters
 
 // RPi to BrickPi
   
@@ -125,13 +192,52 @@
   
   // Sensor setup (MSG_TYPE_SENSOR_TYPE)
     #define BYTE_SENSOR_1_TYPE   1
-    #define BYTE_SENSOR_2_TYPE   2
+    #define BYTE_SENSOR_2_TYPE   2   // Then bits for each port: the I2C settings, or for a raw analog type (0 - 31) 3 bits of oversampling
   
   // Timeout setup (MSG_TYPE_TIMEOUT_SETTINGS)
     #define BYTE_TIMEOUT 1
   
   // Baud setup (MSG_TYPE_BAUD_SETTINGS)
     #define BYTE_BAUD 1   // 1 - 4
+  
+  // Values (MSG_TYPE_VALUES), and the reply
+    #define BYTE_VALUES_SEQ      1 // Sequence number. A repeat of the last one is a retry, which gets the last reply again.
+    #define BYTE_VALUES_BITS     2
+  
+  // Values for every uC (MSG_TYPE_VALUES_ALL)
+    #define BYTE_SLOT_TIME       1 // Width of each reply time slot, in 100 uS units
+    #define BYTE_SECTIONS        2 // For each uC: address, byte count, then the same sequence number and bits as MSG_TYPE_VALUES
+    #define BYTE_REPLY_ADDRESS   1 // The reply has this uC's address, followed by the same sequence number and bits as the MSG_TYPE_VALUES reply
+  
+  // Motor regulation setup (MSG_TYPE_MOTOR_SETTINGS)
+    #define BYTE_MOTOR_SETTINGS  1 // For each motor: mode, KP, KI, KD (low byte first), dead band
+    #define MOTOR_SETTINGS_BYTES 8
+  
+  // Statistics (MSG_TYPE_STATS)
+    #define BYTE_STATS_CLEAR     1
+
+// BrickPi to RPi
+
+  // Sensor setup hash (MSG_TYPE_SENSOR_HASH)
+    #define BYTE_SENSOR_HASH     1 // 2 bytes, low byte first. Not included if the sensors haven't been set up.
+  
+  // Statistics (MSG_TYPE_STATS), all low byte first
+    #define BYTE_STATS_LOOPS          1 // 4 bytes
+    #define BYTE_STATS_REPLIES        5 // 4 bytes
+    #define BYTE_STATS_REPLY_SUM      9 // 4 bytes, uS
+    #define BYTE_STATS_REPLY_MAX     13 // 4 bytes, uS
+    #define BYTE_STATS_UART_ERRORS   17 // 2 bytes each for -3, -4, -5 and -6
+    #define BYTE_STATS_ENCODER_ISR   25 // 4 bytes each for PORT_A and PORT_B
+    #define BYTE_STATS_TIMEOUTS      33 // 2 bytes
+    #define BYTE_STATS_I2C_ERRORS    35 // 2 bytes each for the 8 devices on PORT_1, then PORT_2
+    #define BYTE_STATS_REPEATS       67 // 2 bytes
+    #define STATS_BYTES              69
+
+// The last MSG_TYPE_SENSOR_TYPE message is stored in the EEPROM after the UART address (EEPROM_SETTING_ADDRESS_UART_MY_ADDRESS),
+// and the sensors are set up from it at reset.
+#define EEPROM_SETTING_ADDRESS_SENSOR_BYTES   1   // How many bytes of the message are stored (not counting MSG_TYPE). 0xFF when erased.
+#define EEPROM_SETTING_ADDRESS_SENSOR_HASH    2   // 2 bytes, low byte first
+#define EEPROM_SETTING_ADDRESS_SENSOR_CONFIG  4   // Up to 127 bytes
 
 //#define TYPE_SENSOR_RAW                0 // - 31
 #define TYPE_SENSOR_LIGHT_OFF          0
@@ -151,12 +257,34 @@
 #define BIT_I2C_MID  0x01  // defined for each device
 #define BIT_I2C_SAME 0x02  // defined for each device
 
+// The Arduino IDE generates these, but other compilers (e.g. the native build in BrickPiNative) need them.
+void AddBits(unsigned char byte_offset, unsigned char bit_offset, unsigned char bits, unsigned long value);
+unsigned long GetBits(unsigned char byte_offset, unsigned char bit_offset, unsigned char bits);
+unsigned char BitsNeeded(unsigned long value);
+void ParseSensorSettings();
+uint16_t SensorConfigHash(byte * Config, byte Length);
+void SaveSensorConfig();
+void RestoreSensorConfig();
+void EncodeValues();
+void ParseHandleValues();
+void HandleValues();
+void HandleValuesAll();
+void SetupSensors();
+byte SampleOnRequest(byte port);
+void SampleSensor(byte port);
+void SampleSensors();
+void SampleRequestSensors();
+void StatsPut(byte byte_offset, uint32_t value, byte bytes);
+void EncodeStats();
+void ClearStats();
+
 unsigned long COMM_TIMEOUT = 250; // How many ms since the last communication, before timing out (and floating the motors).
 
 void setup(){
-  UART_Setup(9600);
+  UART_Setup(UART_Get_Baud());                   // The baud rate that the RPi last used, or 9600
   M_Setup();
   A_Setup();
+  RestoreSensorConfig();
 }
 
 int8_t Result;
@@ -165,8 +293,12 @@ byte Array[128];
 
 byte SensorType[2];        // Sensor type (raw ADC, touch, light off, light flash, light on, ultrasonic normal, ultrasonic ping, ultrasonic ping full)
 byte SensorSettings[2][8]; // For specifying the I2C details
+byte SensorOversample[2];  // For raw analog types, average 2^n ADC conversions, and send (n / 2) more bits. 0 for the other types.
+bool SensorConfigured;     // If the sensors have been set up, by MSG_TYPE_SENSOR_TYPE or from the EEPROM
+uint16_t SensorHash;       // The hash of the MSG_TYPE_SENSOR_TYPE message they were set up with
 
-long ENC[2];         // For storing the encoder values
+int32_t ENC[2];      // For storing the encoder values
+uint32_t ENC_Time;   // micros() when ENC was sampled
 long SEN[2];         // For storing sensor values
 long ENC_Offset[2];
 
@@ -179,9 +311,50 @@ uint8_t I2C_Out_Array[2][8][16];  // Data to write to I2C sensor 1 and 2.
 uint8_t I2C_In_Array [2][8][16];  // Data read from I2C sensor 1 and 2.
 
 unsigned long LastUpdate;
+bool TimedOut;                       // If the motors have been floated since the last message, because of COMM_TIMEOUT
+unsigned long BaudPending;           // A new baud rate. It's stored for the next reset once a message is received at it, so the RPi can use it.
+unsigned long BaudConfirmed;
+
+// Each pass of loop() samples at most one port in the background, once that port's period has passed. A message never
+// waits for more than one sample before it's handled, and MSG_TYPE_VALUES replies with the latest values.
+#define SAMPLE_US_ANALOG      1000   // Touch, light and raw analog (the ADC ISR converts these all the time)
+#define SAMPLE_US_COLOR       1000   // Often enough that the color sensor doesn't time out, so it doesn't need CS_KeepAlive
+#define SAMPLE_US_ULTRASONIC 10000   // The sensor doesn't measure any faster than this
+#define SAMPLE_US_I2C         5000
+
+unsigned long SampleDue[2];          // micros() when each port is next sampled
+byte SamplePort;                     // The port to check on the next pass of loop()
+
+// Counters for MSG_TYPE_STATS (the encoder ISR counts are kept by BrickPiM)
+uint32_t StatLoops;
+uint32_t StatReplies;
+uint32_t StatReplySum;
+uint32_t StatReplyMax;
+uint16_t StatUARTErrors[4];          // UART_ReadFrame -3, -4, -5 and -6
+uint16_t StatTimeouts;
+uint16_t StatI2CErrors[2][8];
+uint16_t StatRepeats;                // MSG_TYPE_VALUES sequence numbers that were repeated
+
+// The last MSG_TYPE_VALUES reply (from BYTE_VALUES_SEQ on), for when the RPi retries because the reply didn't reach it.
+// Sending it again doesn't subtract the encoder offsets twice, or do the I2C transfers again.
+byte ValuesSeq;                      // 0 when there isn't one
+byte ValuesReply[127];
+byte ValuesReplyBytes;
 
 void loop(){   
-  Result = UART_ReadArray(Bytes, Array, 1);
+  StatLoops++;
+  Result = UART_ReadFrame(Bytes, Array);         // Doesn't wait, so the rest of loop() keeps running while a message comes in
+  if(Result == 0 || Result == 1){
+    BaudConfirmed = BaudPending;
+    BaudPending = 0;
+    TimedOut = false;
+    if(Array[BYTE_MSG_TYPE] != MSG_TYPE_VALUES && Array[BYTE_MSG_TYPE] != MSG_TYPE_VALUES_ALL){
+      ValuesSeq = 0;                             // Anything else starts a new sequence (e.g. after the RPi restarts)
+    }
+  }
+  else if(Result <= -3 && Result >= -6){
+    StatUARTErrors[(-3 - Result)]++;
+  }
 
   if(Result == 0){
     LastUpdate = millis();
@@ -206,10 +379,15 @@ void loop(){
       baud *= 256;
       baud += Array[BYTE_BAUD];
       UART_Setup(baud);
+      BaudPending = baud;
+    }
+    else if(Array[BYTE_MSG_TYPE] == MSG_TYPE_VALUES_ALL){
+      HandleValuesAll();
     }
   }
   else if(Result == 1){
     LastUpdate = millis();
+    uint32_t RequestTime = micros();
     if(Array[BYTE_MSG_TYPE] == MSG_TYPE_E_STOP){
       M_Float();
       Array[0] = MSG_TYPE_E_STOP;
@@ -227,19 +405,36 @@ void loop(){
       SetupSensors();                                 // Change PORT_1 settings back      
     }
     else if(Array[BYTE_MSG_TYPE] == MSG_TYPE_SENSOR_TYPE){
+      SaveSensorConfig();
       ParseSensorSettings();
       SetupSensors();
       Array[0] = MSG_TYPE_SENSOR_TYPE;
       UART_WriteArray(1, Array);
     }
-    else if(Array[BYTE_MSG_TYPE] == MSG_TYPE_VALUES){
-      ParseHandleValues();
-      UpdateSensors();
-      M_Encoders(ENC[PORT_A], ENC[PORT_B]);      
-      EncodeValues();
+    else if(Array[BYTE_MSG_TYPE] == MSG_TYPE_VALUES && Bytes >= BYTE_VALUES_BITS){
+      HandleValues();
       Array[0] = MSG_TYPE_VALUES;
       UART_WriteArray(Bytes, Array);
     }
+    else if(Array[BYTE_MSG_TYPE] == MSG_TYPE_MOTOR_SETTINGS && Bytes == (1 + (2 * MOTOR_SETTINGS_BYTES))){
+      for(byte port = 0; port < 2; port++){
+        byte * Settings = &Array[(BYTE_MOTOR_SETTINGS + (port * MOTOR_SETTINGS_BYTES))];
+        M_RegSettings(port, Settings[0], (Settings[1] | (Settings[2] << 8)), (Settings[3] | (Settings[4] << 8)), (Settings[5] | (Settings[6] << 8)), Settings[7]);
+      }
+      Array[0] = MSG_TYPE_MOTOR_SETTINGS;
+      UART_WriteArray(1, Array);
+    }
+    else if(Array[BYTE_MSG_TYPE] == MSG_TYPE_SENSOR_HASH){
+      Array[0] = MSG_TYPE_SENSOR_HASH;
+      if(SensorConfigured){
+        Array[BYTE_SENSOR_HASH]     = (SensorHash & 0xFF);
+        Array[BYTE_SENSOR_HASH + 1] = (SensorHash >> 8);
+        UART_WriteArray(3, Array);
+      }
+      else{
+        UART_WriteArray(1, Array);
+      }
+    }
     else if(Array[BYTE_MSG_TYPE] == MSG_TYPE_TIMEOUT_SETTINGS){
       COMM_TIMEOUT = Array[BYTE_TIMEOUT] + (Array[(BYTE_TIMEOUT + 1)] * 256) + (Array[(BYTE_TIMEOUT + 2)] * 65536) + (Array[(BYTE_TIMEOUT + 3)] * 16777216);
       Array[0] = MSG_TYPE_TIMEOUT_SETTINGS;
@@ -252,50 +447,107 @@ void loop(){
       baud *= 256;
       baud += Array[BYTE_BAUD];
       UART_Setup(baud);
+      BaudPending = baud;
       Array[0] = MSG_TYPE_BAUD_SETTINGS;
       UART_WriteArray(1, Array);
     }
+    else if(Array[BYTE_MSG_TYPE] == MSG_TYPE_STATS){
+      bool Clear = (Bytes == 2 && Array[BYTE_STATS_CLEAR] == 1);
+      EncodeStats();
+      UART_WriteArray(STATS_BYTES, Array);
+      if(Clear){
+        ClearStats();
+      }
+    }
+    uint32_t ReplyTime = (micros() - RequestTime);
+    StatReplies++;
+    StatReplySum += ReplyTime;
+    if(ReplyTime > StatReplyMax){
+      StatReplyMax = ReplyTime;
+    }
   }
   
-  if(COMM_TIMEOUT && (millis() > (LastUpdate + COMM_TIMEOUT))){   // If it timed out, float the motors
-    M_Float();
+  if(BaudConfirmed){                             // After the reply, because each EEPROM write takes about 3.3 mS
+    UART_Set_Baud(BaudConfirmed);
+    BaudConfirmed = 0;
   }
   
-  byte i = 0;
-  while(i < 2){
-    if(SensorType[i] == TYPE_SENSOR_COLOR_FULL){
-      CS_KeepAlive(i);                           // Simulate reading the color sensor, so that it doesn't timeout.
+  if(COMM_TIMEOUT && (millis() > (LastUpdate + COMM_TIMEOUT))){   // If it timed out, float the motors
+    M_Float();
+    if(!TimedOut){
+      TimedOut = true;
+      StatTimeouts++;
+      ValuesSeq = 0;
     }
-    i++;
   }
+  
+  SampleSensors();
 }
 
 // The bit offset for packing and unpacking bits to and from "Array"
 unsigned int Bit_Offset = 0;
 
 // Add "bits" number of bits of "value" to "Array"
+// Once the field is byte aligned, whole bytes are stored directly. A byte is only ORed into when an earlier field
+// already started it, so "Array" doesn't need to be cleared first.
 void AddBits(unsigned char byte_offset, unsigned char bit_offset, unsigned char bits, unsigned long value){
-  unsigned char i = 0;
-  while(i < bits){
-    if(value & 0x01){
-      Array[(byte_offset + ((bit_offset + Bit_Offset + i) / 8))] |= (0x01 << ((bit_offset + Bit_Offset + i) % 8));
+  unsigned int Position = (bit_offset + Bit_Offset);
+  byte * Byte = &Array[(byte_offset + (Position >> 3))];
+  byte Shift = (Position & 0x07);
+  Bit_Offset += bits;
+  
+  if(Shift){                                     // Finish the byte that an earlier field started
+    byte Free = (8 - Shift);
+    if(bits < Free){
+      *Byte |= (((byte)value & ((1 << bits) - 1)) << Shift);
+      return;
     }
-    value /= 2;
-    i++;
+    *Byte++ |= ((byte)value << Shift);
+    bits -= Free;
+    value >>= Free;
+  }
+  while(bits >= 8){                              // Byte aligned from here on
+    *Byte++ = (byte)value;
+    value >>= 8;
+    bits -= 8;
+  }
+  if(bits){
+    *Byte = ((byte)value & ((1 << bits) - 1));
   }
-  Bit_Offset += bits;
 }
 
 // Extract "bits" number of bits from "Array"
+// The bits before the first byte boundary are taken with one shift, and the rest are read a whole byte at a time.
 unsigned long GetBits(unsigned char byte_offset, unsigned char bit_offset, unsigned char bits){
+  unsigned int Position = (bit_offset + Bit_Offset);
+  byte * Byte = &Array[(byte_offset + (Position >> 3))];
+  byte Shift = (Position & 0x07);
+  Bit_Offset += bits;
+  
+  byte Low = 0;
+  byte LowBits = 0;
+  if(Shift){                                     // The end of a byte that an earlier field started
+    Low = (*Byte++ >> Shift);
+    LowBits = (8 - Shift);
+    if(bits <= LowBits){
+      return (Low & ((1 << bits) - 1));
+    }
+    bits -= LowBits;
+  }
+  
   unsigned long Result = 0;
-  char i = bits;
-  while(i){
-    Result *= 2;
-    Result |= ((Array[(byte_offset + ((bit_offset + Bit_Offset + (i - 1)) / 8))] >> ((bit_offset + Bit_Offset + (i - 1)) % 8)) & 0x01);    
-    i--;
+  byte Whole = (bits >> 3);
+  byte Rest = (bits & 0x07);
+  if(Rest){
+    Result = (Byte[Whole] & ((1 << Rest) - 1));
+  }
+  while(Whole){                                  // Most significant byte first
+    Whole--;
+    Result = ((Result << 8) | Byte[Whole]);
+  }
+  if(LowBits){
+    Result = ((Result << LowBits) | Low);
   }
-  Bit_Offset += bits;
   return Result;
 }
 
@@ -311,13 +563,72 @@ unsigned char BitsNeeded(unsigned long value){
   return 31;
 }
 
+// CRC-16-CCITT of a MSG_TYPE_SENSOR_TYPE message, not including the MSG_TYPE byte. The RPi calculates it the same way.
+uint16_t SensorConfigHash(byte * Config, byte Length){
+  uint16_t Crc = 0xFFFF;
+  for(byte i = 0; i < Length; i++){
+    Crc ^= (Config[i] << 8);
+    for(byte bit = 0; bit < 8; bit++){
+      if(Crc & 0x8000) Crc = ((Crc << 1) ^ 0x1021);
+      else             Crc <<= 1;
+    }
+  }
+  return Crc;
+}
+
+// Store the MSG_TYPE_SENSOR_TYPE message in "Array" in the EEPROM. Each EEPROM write takes about 3.3 mS, so only the bytes that
+// changed are written. The hash is checked when it's restored, so a reset part way through just loses the setup.
+void SaveSensorConfig(){
+  byte Length = (Bytes - 1);
+  SensorHash = SensorConfigHash(&Array[1], Length);
+  SensorConfigured = true;
+  
+  byte Stored[3] = {Length, (byte)(SensorHash & 0xFF), (byte)(SensorHash >> 8)};
+  for(byte i = 0; i < 3; i++){
+    if(EEPROM.read(EEPROM_SETTING_ADDRESS_SENSOR_BYTES + i) != Stored[i]){
+      EEPROM.write(EEPROM_SETTING_ADDRESS_SENSOR_BYTES + i, Stored[i]);
+    }
+  }
+  for(byte i = 0; i < Length; i++){
+    if(EEPROM.read(EEPROM_SETTING_ADDRESS_SENSOR_CONFIG + i) != Array[1 + i]){
+      EEPROM.write(EEPROM_SETTING_ADDRESS_SENSOR_CONFIG + i, Array[1 + i]);
+    }
+  }
+}
+
+// Set up the sensors from the MSG_TYPE_SENSOR_TYPE message stored in the EEPROM, if there's a valid one
+void RestoreSensorConfig(){
+  byte Length = EEPROM.read(EEPROM_SETTING_ADDRESS_SENSOR_BYTES);
+  if(Length < 2 || Length > 127)                 // At least the two sensor types. 0xFF if it was never stored.
+    return;
+  for(byte i = 0; i < Length; i++){
+    Array[1 + i] = EEPROM.read(EEPROM_SETTING_ADDRESS_SENSOR_CONFIG + i);
+  }
+  uint16_t Hash = (EEPROM.read(EEPROM_SETTING_ADDRESS_SENSOR_HASH) | (EEPROM.read(EEPROM_SETTING_ADDRESS_SENSOR_HASH + 1) << 8));
+  if(SensorConfigHash(&Array[1], Length) != Hash)
+    return;
+  
+  Array[BYTE_MSG_TYPE] = MSG_TYPE_SENSOR_TYPE;
+  Bytes = (Length + 1);
+  SensorHash = Hash;
+  SensorConfigured = true;
+  ParseSensorSettings();
+  SetupSensors();
+}
+
 // Parse incoming settings message, and deal with it
 void ParseSensorSettings(){
   SensorType[PORT_1] = Array[BYTE_SENSOR_1_TYPE];
   SensorType[PORT_2] = Array[BYTE_SENSOR_2_TYPE];
   Bit_Offset = 0;
   for(byte port = 0; port < 2; port++){
-    if(SensorType[port] == TYPE_SENSOR_I2C
+    SensorOversample[port] = 0;
+    if(SensorType[port] < TYPE_SENSOR_TOUCH){
+      SensorOversample[port] = GetBits(3, 0, 3);
+      if(SensorOversample[port] > A_OVERSAMPLE_MAX)
+        SensorOversample[port] = A_OVERSAMPLE_MAX;
+    }
+    else if(SensorType[port] == TYPE_SENSOR_I2C
     || SensorType[port] == TYPE_SENSOR_I2C_9V){
       I2C_Speed[port] = GetBits(3, 0, 8);
       I2C_Devices[port] = (GetBits(3, 0, 3) + 1);
@@ -336,12 +647,8 @@ void ParseSensorSettings(){
   }
 }
 
-// Compress data to send
+// Compress data to send. AddBits stores whole bytes, so Array doesn't need to be cleared first.
 void EncodeValues(){
-  for(byte Byte = 0; Byte < 128; Byte++){
-    Array[Byte] = 0;
-  }
-  
   long Temp_Values[2];
   unsigned char Temp_ENC_DIR[2] = {0, 0};
   unsigned char Temp_BitsNeeded[2] = {0, 0};
@@ -356,38 +663,54 @@ void EncodeValues(){
     Temp_BitsNeeded[port] = BitsNeeded(Temp_Values[port]);
     if(Temp_BitsNeeded[port])
       Temp_BitsNeeded[port]++;
-    AddBits(1, 0, 5, Temp_BitsNeeded[port]);
+    AddBits(BYTE_VALUES_BITS, 0, 5, Temp_BitsNeeded[port]);
   }
   
   for(byte port = 0; port < 2; port++){
     Temp_Values[port] *= 2;
     Temp_Values[port] |= Temp_ENC_DIR[port];     
-    AddBits(1, 0, Temp_BitsNeeded[port], Temp_Values[port]);
+    AddBits(BYTE_VALUES_BITS, 0, Temp_BitsNeeded[port], Temp_Values[port]);
+  }
+  
+  for(byte port = 0; port < 2; port++){
+    long Velocity = M_Velocity(port);
+    unsigned char Dir = 0;
+    if(Velocity < 0){
+      Dir = 1;
+      Velocity *= (-1);
+    }
+    unsigned char Bits = BitsNeeded(Velocity);
+    if(Bits)
+      Bits++;
+    AddBits(BYTE_VALUES_BITS, 0, 5, Bits);
+    AddBits(BYTE_VALUES_BITS, 0, Bits, ((Velocity * 2) | Dir));
   }
+  
+  AddBits(BYTE_VALUES_BITS, 0, 32, ENC_Time);
 
   for(byte port = 0; port < 2; port++){
     switch(SensorType[port]){
       case TYPE_SENSOR_TOUCH:
-        AddBits(1, 0, 1, SEN[port]);
+        AddBits(BYTE_VALUES_BITS, 0, 1, SEN[port]);
       break;
       case TYPE_SENSOR_ULTRASONIC_CONT:
       case TYPE_SENSOR_ULTRASONIC_SS:
-        AddBits(1, 0, 8, SEN[port]);
+        AddBits(BYTE_VALUES_BITS, 0, 8, SEN[port]);
       break;
       case TYPE_SENSOR_COLOR_FULL:
-        AddBits(1, 0, 3, SEN[port]);
-        AddBits(1, 0, 10, CS_Values[port][BLANK_INDEX]);
-        AddBits(1, 0, 10, CS_Values[port][RED_INDEX  ]);
-        AddBits(1, 0, 10, CS_Values[port][GREEN_INDEX]);
-        AddBits(1, 0, 10, CS_Values[port][BLUE_INDEX ]);
+        AddBits(BYTE_VALUES_BITS, 0, 3, SEN[port]);
+        AddBits(BYTE_VALUES_BITS, 0, 10, CS_Values[port][BLANK_INDEX]);
+        AddBits(BYTE_VALUES_BITS, 0, 10, CS_Values[port][RED_INDEX  ]);
+        AddBits(BYTE_VALUES_BITS, 0, 10, CS_Values[port][GREEN_INDEX]);
+        AddBits(BYTE_VALUES_BITS, 0, 10, CS_Values[port][BLUE_INDEX ]);
       break;
       case TYPE_SENSOR_I2C:
       case TYPE_SENSOR_I2C_9V:
-        AddBits(1, 0, I2C_Devices[port], SEN[port]);
+        AddBits(BYTE_VALUES_BITS, 0, I2C_Devices[port], SEN[port]);
         for(byte device = 0; device < I2C_Devices[port]; device++){
           if((SEN[port] >> device) & 0x01){
             for(byte in_byte = 0; in_byte < I2C_In_Bytes[port][device]; in_byte++){
-              AddBits(1, 0, 8, I2C_In_Array[port][device][in_byte]);
+              AddBits(BYTE_VALUES_BITS, 0, 8, I2C_In_Array[port][device][in_byte]);
             }
           }
         }        
@@ -398,11 +721,11 @@ void EncodeValues(){
       case TYPE_SENSOR_COLOR_BLUE:
       case TYPE_SENSOR_COLOR_NONE:
       default:
-        AddBits(1, 0, 10, SEN[port]);
+        AddBits(BYTE_VALUES_BITS, 0, (10 + (SensorOversample[port] / 2)), SEN[port]);
     }
   }
   
-  Bytes = (1 + ((Bit_Offset + 7) / 8));      // How many bytes to send
+  Bytes = (BYTE_VALUES_BITS + ((Bit_Offset + 7) / 8));      // How many bytes to send
 }
 
 // Parse incoming message, and deal with it
@@ -410,8 +733,8 @@ void ParseHandleValues(){
   Bit_Offset = 0;
   
   for(byte port = 0; port < 2; port++){
-    if(GetBits(1, 0, 1)){
-      ENC_Offset[port] = GetBits(1, 0, (GetBits(1, 0, 5) + 1));
+    if(GetBits(BYTE_VALUES_BITS, 0, 1)){
+      ENC_Offset[port] = GetBits(BYTE_VALUES_BITS, 0, (GetBits(BYTE_VALUES_BITS, 0, 5) + 1));
       if(ENC_Offset[port] & 0x01){
         ENC_Offset[port] *= (-1);
       }
@@ -427,7 +750,24 @@ void ParseHandleValues(){
   }
   
   for(byte port = 0; port < 2; port++){
-    M_PWM(port, GetBits(1, 0, 10));              // 8 bits of PWM, 1 bit dir, 1 bit enable
+    uint16_t control = GetBits(BYTE_VALUES_BITS, 0, 10);        // 8 bits of PWM, 1 bit dir, 1 bit enable
+    if(control == M_CONTROL_REGULATED){          // Regulated by the FW, optionally with a new target
+      if(GetBits(BYTE_VALUES_BITS, 0, 1)){
+        int32_t Target = GetBits(BYTE_VALUES_BITS, 0, (GetBits(BYTE_VALUES_BITS, 0, 5) + 1));
+        if(Target & 0x01){
+          Target = -(Target / 2);
+        }
+        else{
+          Target /= 2;
+        }
+        M_RegTarget(port, Target);
+      }
+      M_RegStart(port);
+    }
+    else{
+      M_RegStop(port);
+      M_PWM(port, control);
+    }
   }
   
   for(byte port = 0; port < 2; port++){
@@ -435,10 +775,10 @@ void ParseHandleValues(){
     || SensorType[port] == TYPE_SENSOR_I2C_9V){  
       for(byte device = 0; device < I2C_Devices[port]; device ++){
         if(!(SensorSettings[port][device] & BIT_I2C_SAME)){           // not same
-          I2C_Out_Bytes[port][device]       = GetBits(1, 0, 4);
-          I2C_In_Bytes [port][device]       = GetBits(1, 0, 4);
+          I2C_Out_Bytes[port][device]       = GetBits(BYTE_VALUES_BITS, 0, 4);
+          I2C_In_Bytes [port][device]       = GetBits(BYTE_VALUES_BITS, 0, 4);
           for(byte ii = 0; ii < I2C_Out_Bytes[port][device]; ii++){
-            I2C_Out_Array[port][device][ii] = GetBits(1, 0, 8);
+            I2C_Out_Array[port][device][ii] = GetBits(BYTE_VALUES_BITS, 0, 8);
           }
         }
       }
@@ -446,12 +786,60 @@ void ParseHandleValues(){
   }
 }
 
+// Handle the MSG_TYPE_VALUES message in "Array", and leave the reply in "Array" from BYTE_VALUES_SEQ on, with "Bytes" set
+// for the whole reply. A retry of the last message gets the same reply again.
+void HandleValues(){
+  byte Seq = Array[BYTE_VALUES_SEQ];
+  if(Seq && Seq == ValuesSeq){
+    StatRepeats++;
+    memcpy(&Array[BYTE_VALUES_SEQ], ValuesReply, ValuesReplyBytes);
+    Bytes = (BYTE_VALUES_SEQ + ValuesReplyBytes);
+    return;
+  }
+  ParseHandleValues();
+  SampleRequestSensors();
+  M_Snapshot(ENC[PORT_A], ENC[PORT_B], ENC_Time);
+  EncodeValues();
+  Array[BYTE_VALUES_SEQ] = Seq;
+  ValuesSeq = Seq;
+  ValuesReplyBytes = (Bytes - BYTE_VALUES_SEQ);
+  memcpy(ValuesReply, &Array[BYTE_VALUES_SEQ], ValuesReplyBytes);
+}
+
+// Find this uC's section of a MSG_TYPE_VALUES_ALL message, handle it just like MSG_TYPE_VALUES, and reply in this uC's time slot
+void HandleValuesAll(){
+  unsigned long Received = micros();
+  byte MyAddr = UART_My_Addr();
+  byte Slot = 0;
+  unsigned int Section = BYTE_SECTIONS;
+  while((Section + 2) <= Bytes && Array[Section] != MyAddr){
+    Section += (2 + Array[Section + 1]);
+    Slot++;
+  }
+  if((Section + 2) > Bytes || (Section + 2 + Array[Section + 1]) > Bytes || Array[Section + 1] < BYTE_VALUES_SEQ)   // Not included in this message
+    return;
+  
+  unsigned long SlotStart = ((unsigned long)Slot * Array[BYTE_SLOT_TIME] * 100);
+  
+  memmove(&Array[BYTE_VALUES_SEQ], &Array[Section + 2], Array[Section + 1]);   // Move this uC's section to where HandleValues expects it
+  HandleValues();
+  memmove(&Array[BYTE_REPLY_ADDRESS + 1], &Array[1], (Bytes - 1));         // Make room for the address
+  Array[0] = MSG_TYPE_VALUES_ALL;
+  Array[BYTE_REPLY_ADDRESS] = MyAddr;
+  Bytes++;
+  
+  while((micros() - Received) < SlotStart);                                 // Wait for this uC's time slot
+  UART_WriteArray(Bytes, Array);
+}
+
 // Configure sensors
 void SetupSensors(){
   for(byte port = 0; port < 2; port++){  
+    A_FreeStop(port);
     switch(SensorType[port]){
       case TYPE_SENSOR_TOUCH:
         A_Config(port, 0);
+        A_Free(port, 0);
       break;
       case TYPE_SENSOR_ULTRASONIC_CONT:
         US_Setup(port);
@@ -487,46 +875,155 @@ void SetupSensors(){
       break;      
       default:
         A_Config(port, SensorType[port]);
+        A_Free(port, SensorOversample[port]);
+    }
+  }
+  
+  for(byte port = 0; port < 2; port++){                      // So that the first reply already has values
+    SEN[port] = 0;
+    if(!SampleOnRequest(port)){
+      SampleSensor(port);
     }
-  }  
+    SampleDue[port] = micros();
+  }
 }
 
-// Read sensors
-void UpdateSensors(){
+// An I2C port with a device that isn't BIT_I2C_SAME gets what to write with each MSG_TYPE_VALUES, so it can only be sampled then
+byte SampleOnRequest(byte port){
+  if(SensorType[port] == TYPE_SENSOR_I2C
+  || SensorType[port] == TYPE_SENSOR_I2C_9V){
+    for(byte device = 0; device < I2C_Devices[port]; device++){
+      if(!(SensorSettings[port][device] & BIT_I2C_SAME)){
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Check one port each pass of loop(), and sample it if it's due
+void SampleSensors(){
+  byte port = SamplePort;
+  SamplePort ^= 1;
+  if(SampleOnRequest(port) || (long)(micros() - SampleDue[port]) < 0)
+    return;
+  
+  SampleSensor(port);
+  
+  unsigned long Period;
+  switch(SensorType[port]){
+    case TYPE_SENSOR_ULTRASONIC_CONT:
+    case TYPE_SENSOR_ULTRASONIC_SS:
+      Period = SAMPLE_US_ULTRASONIC;
+    break;
+    case TYPE_SENSOR_COLOR_FULL:
+    case TYPE_SENSOR_COLOR_RED:
+    case TYPE_SENSOR_COLOR_GREEN:
+    case TYPE_SENSOR_COLOR_BLUE:
+    case TYPE_SENSOR_COLOR_NONE:
+      Period = SAMPLE_US_COLOR;
+    break;
+    case TYPE_SENSOR_I2C:
+    case TYPE_SENSOR_I2C_9V:
+      Period = SAMPLE_US_I2C;
+    break;
+    default:
+      Period = SAMPLE_US_ANALOG;
+  }
+  SampleDue[port] = (micros() + Period);
+}
+
+// Sample the ports that can't be sampled in the background, with what ParseHandleValues just received. Reading the latest average
+// of an analog port that the ADC ISR is converting doesn't wait, so those are refreshed too.
+void SampleRequestSensors(){
   for(byte port = 0; port < 2; port++){
-    switch(SensorType[port]){
-      case TYPE_SENSOR_TOUCH:
-        if(A_ReadRaw(port) < 400) SEN[port] = 1;
-        else                      SEN[port] = 0;
-      break;
-      case TYPE_SENSOR_ULTRASONIC_CONT:
-        SEN[port] = US_ReadByte(port);
-      break;
-      case TYPE_SENSOR_ULTRASONIC_SS:
-        SEN[port] = 37;                 // FIXME add support for SS mode
-      break;
-      case TYPE_SENSOR_RCX_LIGHT:
-        A_Config(port, 0);
-        delayMicroseconds(20);
-        SEN[port] = A_ReadRaw(port);
-        A_Config(port, MASK_9V);
-      break;
-      case TYPE_SENSOR_COLOR_FULL:
-      case TYPE_SENSOR_COLOR_RED:
-      case TYPE_SENSOR_COLOR_GREEN:
-      case TYPE_SENSOR_COLOR_BLUE:
-      case TYPE_SENSOR_COLOR_NONE:
-        SEN[port] = CS_Update(port);      // If the mode is FULL, the 4 raw values will be stored in CS_Values
-      break;
-      case TYPE_SENSOR_I2C:
-      case TYPE_SENSOR_I2C_9V:
-        SEN[port] = 0;
-        for(byte device = 0; device < I2C_Devices[port]; device++){
-          SEN[port] |= ((I2C_Transfer(port, I2C_Addr[port][device], I2C_Speed[port], (SensorSettings[port][device] & BIT_I2C_MID), I2C_Out_Bytes[port][device], I2C_Out_Array[port][device], I2C_In_Bytes[port][device], I2C_In_Array[port][device]) & 0x01) << device); // The success/failure result of the I2C transaction(s) is stored as 1 bit in SEN.
+    if(SampleOnRequest(port) || A_FreeRunning(port)){
+      SampleSensor(port);
+    }
+  }
+}
+
+// Read a sensor into SEN (and CS_Values or I2C_In_Array)
+void SampleSensor(byte port){
+  switch(SensorType[port]){
+    case TYPE_SENSOR_TOUCH:
+      if(A_ReadFree(port) < 400) SEN[port] = 1;
+      else                       SEN[port] = 0;
+    break;
+    case TYPE_SENSOR_ULTRASONIC_CONT:
+      SEN[port] = US_ReadByte(port);
+    break;
+    case TYPE_SENSOR_ULTRASONIC_SS:
+      SEN[port] = 37;                 // FIXME add support for SS mode
+    break;
+    case TYPE_SENSOR_RCX_LIGHT:
+      A_Config(port, 0);
+      delayMicroseconds(20);
+      SEN[port] = A_ReadRaw(port);
+      A_Config(port, MASK_9V);
+    break;
+    case TYPE_SENSOR_COLOR_FULL:
+    case TYPE_SENSOR_COLOR_RED:
+    case TYPE_SENSOR_COLOR_GREEN:
+    case TYPE_SENSOR_COLOR_BLUE:
+    case TYPE_SENSOR_COLOR_NONE:
+      SEN[port] = CS_Update(port);      // If the mode is FULL, the 4 raw values will be stored in CS_Values
+    break;
+    case TYPE_SENSOR_I2C:
+    case TYPE_SENSOR_I2C_9V:
+      SEN[port] = 0;
+      for(byte device = 0; device < I2C_Devices[port]; device++){
+        byte Success = (I2C_Transfer(port, I2C_Addr[port][device], I2C_Speed[port], (SensorSettings[port][device] & BIT_I2C_MID), I2C_Out_Bytes[port][device], I2C_Out_Array[port][device], I2C_In_Bytes[port][device], I2C_In_Array[port][device]) & 0x01);
+        SEN[port] |= (Success << device); // The success/failure result of the I2C transaction(s) is stored as 1 bit in SEN.
+        if(!Success){
+          StatI2CErrors[port][device]++;
         }
-      break;
-      default:
-        SEN[port] = A_ReadRaw(port);
+      }
+    break;
+    default:
+      SEN[port] = A_ReadFree(port);
+  }
+}
+
+// Put "bytes" bytes of "value" into "Array", low byte first
+void StatsPut(byte byte_offset, uint32_t value, byte bytes){
+  for(byte i = 0; i < bytes; i++){
+    Array[byte_offset + i] = (value & 0xFF);
+    value >>= 8;
+  }
+}
+
+// Encode the MSG_TYPE_STATS reply into "Array"
+void EncodeStats(){
+  uint32_t ISR_A, ISR_B;
+  M_ISRCounts(ISR_A, ISR_B);
+  Array[0] = MSG_TYPE_STATS;
+  StatsPut(BYTE_STATS_LOOPS,     StatLoops,    4);
+  StatsPut(BYTE_STATS_REPLIES,   StatReplies,  4);
+  StatsPut(BYTE_STATS_REPLY_SUM, StatReplySum, 4);
+  StatsPut(BYTE_STATS_REPLY_MAX, StatReplyMax, 4);
+  for(byte i = 0; i < 4; i++){
+    StatsPut((BYTE_STATS_UART_ERRORS + (i * 2)), StatUARTErrors[i], 2);
+  }
+  StatsPut(BYTE_STATS_ENCODER_ISR,     ISR_A, 4);
+  StatsPut(BYTE_STATS_ENCODER_ISR + 4, ISR_B, 4);
+  StatsPut(BYTE_STATS_TIMEOUTS, StatTimeouts, 2);
+  for(byte port = 0; port < 2; port++){
+    for(byte device = 0; device < 8; device++){
+      StatsPut((BYTE_STATS_I2C_ERRORS + (((port * 8) + device) * 2)), StatI2CErrors[port][device], 2);
     }
   }
-}
\ No newline at end of file
+  StatsPut(BYTE_STATS_REPEATS, StatRepeats, 2);
+}
+
+void ClearStats(){
+  StatLoops = 0;
+  StatReplies = 0;
+  StatReplySum = 0;
+  StatReplyMax = 0;
+  StatTimeouts = 0;
+  StatRepeats = 0;
+  memset(StatUARTErrors, 0, sizeof(StatUARTErrors));
+  memset(StatI2CErrors, 0, sizeof(StatI2CErrors));
+  M_ISRCountsClear();
+}
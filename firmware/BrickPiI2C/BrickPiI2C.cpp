@@ -184,6 +184,7 @@ void I2C_SCL_LOW_EX(){
 uint8_t I2C_Start(){
   I2C_SDA_LOW;                                         // start condition
   I2C_WAIT;
+  return 0;
 }
 
 // Send the bus Stop condition
@@ -24,12 +24,19 @@ void M_Setup(){
   PCMSK2 |= 0x3C;                 // React to PCINT 18, 19, 20, and 21.
   PCICR |= 0x04;                  // Enable PCINT Enable 2
   
+  // Run the motor regulation from Timer 0 compare A. Timer 0 is already running for millis (overflowing at 976.5 Hz), so this
+  // just adds a second interrupt in the middle of each period.
+  OCR0A = 0x80;
+  TIMSK0 |= 0x02;                 // OCIE0A
+  
   // Setup EN, PWM and DIR as LOW. Setup the EN, PWM, and DIR pins as outputs. 
   PORTB = PORTB & 0xC0;  // Leave PB6 and 7 alone. 0, 1, 2, 3, 4, and 5 LOW.
   DDRB  |= 0x3F;                  // Set PB0 - 5 as output  
 }
 
 void M_PWM(uint8_t port, uint16_t control){ // 8 bits of PWM, 1 bit dir, 1 bit enable
+  uint8_t sreg = SREG;                        // The regulation ISR uses M_PWM too, and they share PORTB
+  cli();
   if(port == PORT_A){
     if(control & 0x01){
 #if BrickPiVersion   == 1                             // Enable motor A
@@ -114,33 +121,97 @@ void M_PWM(uint8_t port, uint16_t control){ // 8 bits of PWM, 1 bit dir, 1 bit e
 #endif
     }    
   }
+  SREG = sreg;
 }
 
 void M_Float(){
+  uint8_t sreg = SREG;
+  cli();
+  RegActive[PORT_A] = 0;
+  RegActive[PORT_B] = 0;
   PORTB &= 0xC0;
+  SREG = sreg;
 }
 
+// Enc is 32 bits, so reading it takes several instructions, and PCINT2_vect could change it part way through. Interrupts are turned
+// off while the encoders are copied (or changed), and no longer.
 void M_Encoders(int32_t & MAE, int32_t & MBE){
+  uint8_t sreg = SREG;
+  cli();
   MAE = Enc[0];
   MBE = Enc[1];
+  SREG = sreg;
+}
+
+void M_ISRCounts(uint32_t & MAC, uint32_t & MBC){
+  uint8_t sreg = SREG;
+  cli();
+  MAC = EncISR[0];
+  MBC = EncISR[1];
+  SREG = sreg;
+}
+
+void M_ISRCountsClear(){
+  uint8_t sreg = SREG;
+  cli();
+  EncISR[0] = 0;
+  EncISR[1] = 0;
+  SREG = sreg;
+}
+
+// Take a consistent snapshot of both encoders, the times of their last transitions (for M_Velocity), and the micros() time it was taken.
+// micros() turns interrupts off anyway, so taking it inside the same critical section costs very little.
+void M_Snapshot(int32_t & MAE, int32_t & MBE, uint32_t & Time){
+  uint8_t sreg = SREG;
+  cli();
+  SnapEnc[0] = Enc[0];
+  SnapEnc[1] = Enc[1];
+  SnapEncTime[0] = EncTime[0];
+  SnapEncTime[1] = EncTime[1];
+  SnapTime = micros();
+  SREG = sreg;
+  MAE = SnapEnc[0];
+  MBE = SnapEnc[1];
+  Time = SnapTime;
 }
 
 int32_t M_Encoder(uint8_t port){
   if(port > PORT_B)
     return 0;
-  return Enc[port];
+  uint8_t sreg = SREG;
+  cli();
+  int32_t value = Enc[port];
+  SREG = sreg;
+  return value;
 }
 
+// An offset isn't movement, so everything that the velocity and the speed regulation measure against moves along with the encoders
 void M_EncodersSubtract(int32_t MAE_Offset, int32_t MBE_Offset){
-  Enc[0] -= MAE_Offset;
-  Enc[1] -= MBE_Offset;
+  int32_t offset[2] = {MAE_Offset, MBE_Offset};
+  uint8_t sreg = SREG;
+  cli();
+  for(uint8_t port = PORT_A; port <= PORT_B; port++){
+    Enc[port] -= offset[port];
+    VelEnc[port] -= offset[port];
+    RegSetpoint[port] -= offset[port];
+    if(RegMode[port] == M_REG_SPEED){
+      for(uint8_t i = 0; i < M_REG_D_SAMPLES; i++){
+        RegHistory[port][i] -= offset[port];
+      }
+    }
+  }
+  SREG = sreg;
 }
 
 void M_T_ISR(uint8_t port){
 
+  EncISR[port]++;
   State[port] = (((State[port] << 2) | (((PIND >> (1 + port)) & 0x02) | ((PIND >> (4 + port)) & 0x01))) & 0x0F);
   
-  Enc[port] += Enc_States[State[port]];
+  if(Enc_States[State[port]]){
+    Enc[port] += Enc_States[State[port]];
+    EncTime[port] = micros();
+  }
   
 /*  Temp_Enc_Val[port] += Enc_States[State[port]];
 
@@ -156,6 +227,201 @@ void M_T_ISR(uint8_t port){
   }*/
 }
 
+// The velocity is the number of ticks between the last transition before the previous snapshot and the last transition before the latest
+// snapshot, divided by the time between those two transitions. Timing whole ticks from edge to edge gives a good estimate at low speeds, where
+// counting ticks over a short fixed period doesn't. With no new transitions, the estimate can only be as fast as one tick in the time
+// since the last transition, so it decays towards 0, and is 0 after M_VELOCITY_TIMEOUT_US.
+int32_t M_Velocity(uint8_t port){
+  if(port > PORT_B)
+    return 0;
+  int32_t  enc  = SnapEnc[port];
+  uint32_t time = SnapEncTime[port];
+  uint32_t now  = SnapTime;
+  
+  if(enc != VelEnc[port]){
+    uint32_t start = VelTime[port];
+    if((VelCall[port] - start) > M_VELOCITY_TIMEOUT_US){          // It was stopped, so start timing from the previous call instead
+      start = VelCall[port];
+    }
+    uint32_t dt = time - start;
+    int32_t delta = constrain((enc - VelEnc[port]), -100000, 100000);
+    if(dt >= 64){
+      Velocity[port] = constrain(((delta * (1000000 / 64)) / (int32_t)(dt / 64)), -M_VELOCITY_MAX, M_VELOCITY_MAX);
+    }
+    VelEnc[port] = enc;
+    VelTime[port] = time;
+  }
+  else{
+    uint32_t since = now - VelTime[port];
+    if(since > M_VELOCITY_TIMEOUT_US){
+      Velocity[port] = 0;
+    }
+    else{
+      int32_t bound = 1000000 / (int32_t)(since | 1);
+      if(Velocity[port] > bound){
+        Velocity[port] = bound;
+      }
+      else if(Velocity[port] < -bound){
+        Velocity[port] = -bound;
+      }
+    }
+  }
+  VelCall[port] = now;
+  return Velocity[port];
+}
+
+void M_RegSettings(uint8_t port, uint8_t mode, uint16_t kp, uint16_t ki, uint16_t kd, uint8_t dead){
+  if(port > PORT_B)
+    return;
+  uint8_t sreg = SREG;
+  cli();
+  RegActive[port] = 0;
+  RegMode[port] = mode;
+  RegKP[port] = kp;
+  RegKI[port] = ki;
+  RegKD[port] = kd;
+  RegDead[port] = dead;
+  RegIntegralMax[port] = (ki ? (65280 / ki) : 0);
+  SREG = sreg;
+  if(mode == M_REG_NONE)
+    M_PWM(port, 0);
+}
+
+// For M_REG_SPEED, the ticks per period = target * 1024 / 1000000 = target * 16 / 15625, split here into whole ticks and a remainder,
+// so that the ISR only has to add them up.
+void M_RegTarget(uint8_t port, int32_t target){
+  if(port > PORT_B)
+    return;
+  int32_t scaled = target * (M_REG_PERIOD_US / 64);
+  int32_t ticks = scaled / 15625;
+  int32_t remainder = scaled - (ticks * 15625);
+  if(remainder < 0){
+    remainder += 15625;
+    ticks--;
+  }
+  uint8_t sreg = SREG;
+  cli();
+  RegTarget[port] = target;
+  RegTicks[port] = ticks;
+  RegRemainder[port] = remainder;
+  SREG = sreg;
+}
+
+// Start regulating, if it isn't already. For M_REG_POSITION the history starts full of the current error, so that there isn't a derivative
+// kick, and for M_REG_SPEED it starts full of the current encoder value, so that the motor starts out measured as stopped.
+void M_RegStart(uint8_t port){
+  if(port > PORT_B || RegActive[port])
+    return;
+  if(RegMode[port] == M_REG_NONE){
+    M_PWM(port, 0);
+    return;
+  }
+  uint8_t sreg = SREG;
+  cli();
+  int16_t sample;
+  if(RegMode[port] == M_REG_SPEED){
+    sample = Enc[port];
+  }
+  else{
+    sample = constrain((RegTarget[port] - Enc[port]), -M_REG_ERROR_MAX, M_REG_ERROR_MAX);
+  }
+  for(uint8_t i = 0; i < M_REG_D_SAMPLES; i++){
+    RegHistory[port][i] = sample;
+  }
+  RegIntegral[port] = 0;
+  RegSetpoint[port] = Enc[port];
+  RegFraction[port] = 0;
+  RegActive[port] = 1;
+  SREG = sreg;
+}
+
+void M_RegStop(uint8_t port){
+  if(port > PORT_B)
+    return;
+  RegActive[port] = 0;
+}
+
+// One period of the PD(+I) position regulation
+int32_t M_RegulatePosition(uint8_t port){
+  int32_t error = constrain((RegTarget[port] - Enc[port]), -M_REG_ERROR_MAX, M_REG_ERROR_MAX);
+  int32_t last = RegHistory[port][RegHistoryIndex[port]];   // The error M_REG_D_SAMPLES periods ago
+  RegHistory[port][RegHistoryIndex[port]] = error;
+  RegHistoryIndex[port] = ((RegHistoryIndex[port] + 1) % M_REG_D_SAMPLES);
+  
+  if(RegKI[port]){
+    RegIntegral[port] = constrain((RegIntegral[port] + error), -RegIntegralMax[port], RegIntegralMax[port]);
+  }
+  
+  return (((int32_t)RegKP[port] * error) + ((int32_t)RegKI[port] * RegIntegral[port]) + ((int32_t)RegKD[port] * (error - last))) / 256;
+}
+
+// One period of the PI speed regulation. The speed is the encoder delta over the last M_REG_D_SAMPLES periods. The integral of the speed
+// error is how far the motor is behind (or ahead of) where it would be if it had always been at the target speed, so KI is in the same
+// units as the position KP, and the motor makes up any ticks it lost (e.g. while stalled, up to the integral limit). KD isn't used.
+int32_t M_RegulateSpeed(uint8_t port){
+  int16_t enc = Enc[port];
+  int16_t delta = enc - RegHistory[port][RegHistoryIndex[port]];  // 16 bits is plenty for M_REG_D_SAMPLES periods, even across the wrap
+  RegHistory[port][RegHistoryIndex[port]] = enc;
+  RegHistoryIndex[port] = ((RegHistoryIndex[port] + 1) % M_REG_D_SAMPLES);
+  
+  RegSetpoint[port] += RegTicks[port];                            // The ticks per period, from M_RegTarget
+  RegFraction[port] += RegRemainder[port];
+  if(RegFraction[port] >= 15625){
+    RegFraction[port] -= 15625;
+    RegSetpoint[port]++;
+  }
+  
+  int32_t behind = RegSetpoint[port] - Enc[port];
+  if(behind > RegIntegralMax[port] || behind < -RegIntegralMax[port]){ // Don't wind up. Let the setpoint go where the motor can't follow.
+    behind = constrain(behind, -RegIntegralMax[port], RegIntegralMax[port]);
+    RegSetpoint[port] = Enc[port] + behind;
+  }
+  
+  int32_t speed = ((int32_t)delta * (1000000 / 64)) / ((M_REG_PERIOD_US / 64) * M_REG_D_SAMPLES);   // Ticks per second
+  int32_t error = constrain((RegTarget[port] - speed), -M_REG_ERROR_MAX, M_REG_ERROR_MAX);
+  
+  return (((int32_t)RegKP[port] * error) + ((int32_t)RegKI[port] * behind)) / 256;
+}
+
+// One regulator period. The gains are 8.8 fixed point, and the dead band is applied like the RPi does.
+void M_Regulate(uint8_t port){
+  if(!RegActive[port])
+    return;
+  
+  int32_t speed;
+  if(RegMode[port] == M_REG_SPEED){
+    speed = M_RegulateSpeed(port);
+  }
+  else{
+    speed = M_RegulatePosition(port);
+  }
+  
+  if(speed < RegDead[port] && speed > -RegDead[port]){
+    speed = 0;
+  }
+  if(speed > 0){
+    speed += RegDead[port];
+  }
+  else if(speed < 0){
+    speed -= RegDead[port];
+  }
+  
+  uint16_t control = 0x01;
+  if(speed < 0){
+    control |= 0x02;
+    speed = -speed;
+  }
+  if(speed > 255){
+    speed = 255;
+  }
+  M_PWM(port, (control | (speed << 2)));
+}
+
+ISR(TIMER0_COMPA_vect){
+  M_Regulate(PORT_A);
+  M_Regulate(PORT_B);
+}
+
 ISR(PCINT2_vect){
   uint8_t curr;
   uint8_t mask;
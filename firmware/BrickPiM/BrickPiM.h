@@ -30,6 +30,20 @@
 #define PORT_A 0
 #define PORT_B 1
 
+#define M_REG_NONE          0      // Motor regulation modes. With M_REG_NONE, the motor is only controlled by M_PWM.
+#define M_REG_POSITION      1      // Run the motor to RegTarget, and hold it there
+#define M_REG_SPEED         2      // Run the motor at RegTarget encoder ticks per second
+
+#define M_CONTROL_REGULATED 0x002  // The M_PWM control value (reverse, but not enabled) that the RPi sends for a motor that the FW regulates
+
+#define M_REG_D_SAMPLES     8      // The derivative is the change in error over this many regulator periods (about 8 ms), which is close to
+                                   // the RPi's update period, so the gains mean about the same as they do for RPi regulation.
+#define M_REG_ERROR_MAX     8191   // Larger errors are clipped, so that the fixed point math can't overflow
+#define M_REG_PERIOD_US     1024   // The regulator period (Timer 0 compare A)
+
+#define M_VELOCITY_TIMEOUT_US 250000 // With no encoder transitions for this long, the motor is reported as stopped
+#define M_VELOCITY_MAX      65535  // Ticks per second. Limits the size of the velocity in the VALUES reply.
+
 volatile static int32_t Enc[2];
 
 void M_Setup();
@@ -38,10 +52,23 @@ void M_PWM(uint8_t port, uint16_t control); // 8 bits of PWM, 1 bit dir, 1 bit e
 void M_Float();
 
 void M_Encoders(int32_t & MAE, int32_t & MBE);
+void M_Snapshot(int32_t & MAE, int32_t & MBE, uint32_t & Time); // Both encoders and micros(), all at the same instant
 int32_t M_Encoder(uint8_t port);
 void M_EncodersSubtract(int32_t MAE_Offset, int32_t MBE_Offset);
 
 void M_T_ISR(uint8_t port);
+void M_ISRCounts(uint32_t & MAC, uint32_t & MBC);  // How many times M_T_ISR has run for each port
+void M_ISRCountsClear();
+
+int32_t M_Velocity(uint8_t port);           // Ticks per second, up to the last M_Snapshot, timed from the encoder transitions
+
+void M_RegSettings(uint8_t port, uint8_t mode, uint16_t kp, uint16_t ki, uint16_t kd, uint8_t dead); // Gains are 8.8 fixed point
+void M_RegTarget(uint8_t port, int32_t target);                     // Encoder ticks (M_REG_POSITION) or ticks per second (M_REG_SPEED)
+void M_RegStart(uint8_t port);
+void M_RegStop(uint8_t port);
+int32_t M_RegulatePosition(uint8_t port);
+int32_t M_RegulateSpeed(uint8_t port);
+void M_Regulate(uint8_t port);
 
 //                         0000 0001 0010 0011 0100 0101 0110 0111 1000 1001 1010 1011 1100 1101 1110 1111
 static int Enc_States[] = {   0,  -1,   1,   0,   1,   0,   0,  -1,  -1,   0,   0,   1,   0,   1,  -1,   0};
@@ -50,5 +77,36 @@ volatile static uint8_t State[2]        = {0, 0};
 volatile static int8_t  Temp_Enc_Val[2] = {0, 0};
 volatile static uint8_t PCintLast;
 
+volatile static uint32_t EncTime[2];                 // micros() of the last encoder transition
+volatile static uint32_t EncISR[2];                  // How many times M_T_ISR has run, for MSG_TYPE_STATS
+
+// The last M_Snapshot
+static int32_t  SnapEnc[2];
+static uint32_t SnapEncTime[2];
+static uint32_t SnapTime;
+
+// Velocity measurement, between calls to M_Velocity
+static int32_t  VelEnc[2];                           // The encoder value at the last transition before the previous snapshot
+static uint32_t VelTime[2];                          //   '' and when it happened
+static uint32_t VelCall[2];                          // When the snapshot for the previous call was taken
+static int32_t  Velocity[2];                         // The last result
+
+// Motor regulation, run from the TIMER0_COMPA ISR at about 1 kHz
+volatile static uint8_t  RegMode[2]     = {M_REG_NONE, M_REG_NONE};
+volatile static uint8_t  RegActive[2]   = {0, 0};
+volatile static int32_t  RegTarget[2];
+static uint16_t RegKP[2];
+static uint16_t RegKI[2];
+static uint16_t RegKD[2];
+static uint8_t  RegDead[2];
+static int32_t  RegIntegral[2];
+static int32_t  RegIntegralMax[2];                   // The integral term alone can't ask for more than full power
+static int16_t  RegHistory[2][M_REG_D_SAMPLES];      // The last M_REG_D_SAMPLES errors (M_REG_POSITION) or encoder values (M_REG_SPEED)
+static uint8_t  RegHistoryIndex[2];
+static int32_t  RegSetpoint[2];                      // M_REG_SPEED: where the motor should be by now, RegTarget ticks/s since it started
+static uint16_t RegFraction[2];                      //   '' : the fraction of a tick, in 1/15625ths
+volatile static int32_t  RegTicks[2];                // M_REG_SPEED: RegTarget in whole ticks per period, rounded down
+volatile static uint16_t RegRemainder[2];            //   '' : and the rest, in 1/15625ths of a tick per period
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,78 @@
+/*
+*  You may use this code as you wish, provided you give credit where it's due.
+*
+*  This is a shim of the parts of the Arduino core that the BrickPi FW uses, so that the FW can be compiled as a native Linux program.
+*  See BrickPiNative.cpp.
+*/
+
+#ifndef __Arduino_h_
+#define __Arduino_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+typedef uint8_t byte;
+typedef bool    boolean;
+
+// An 8 bit AVR register. "Written" is called after each write, so that the shim can emulate the HW (e.g. the ADC).
+struct ShimReg{
+  volatile uint8_t Value;
+  void (*Written)(void);
+  
+  operator uint8_t() const          { return Value; }
+  ShimReg & operator =  (uint8_t v) { Value = v; if(Written) Written(); return *this; }
+  ShimReg & operator |= (uint8_t v) { return (*this = (Value | v)); }
+  ShimReg & operator &= (uint8_t v) { return (*this = (Value & v)); }
+  ShimReg & operator ^= (uint8_t v) { return (*this = (Value ^ v)); }
+};
+
+extern ShimReg DDRB, PORTB, DDRC, PORTC, DDRD, PORTD, PIND;
+extern ShimReg ADCSRA, ADMUX, ADCL, ADCH;
+extern ShimReg PCMSK2, PCICR, SREG;
+extern ShimReg OCR0A, TIMSK0;
+
+uint8_t ShimPINC(void);
+#define PINC (ShimPINC())                     // Lines that aren't driven low are pulled high
+
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIF  4
+#define ADIE  3
+#define ADATE 5
+#define ADSC  6
+#define ADEN  7
+
+#define ISR(vector) extern "C" void vector(void)
+extern "C" void PCINT2_vect(void);
+extern "C" void TIMER0_COMPA_vect(void);
+extern "C" void ADC_vect(void);
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+void cli(void);
+void sei(void);
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void analogWrite(uint8_t pin, int value);
+
+#define SERIAL_BUFFER_SIZE 64                 // The same as the Arduino core for the ATmega328. Bytes received while it's full are lost.
+
+// The Serial port, connected to the host through a socket
+class HardwareSerial{
+  public:
+    void   begin(unsigned long baud);
+    int    available(void);
+    int    read(void);
+    size_t write(uint8_t data);
+    size_t write(const uint8_t *buffer, size_t size);
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,536 @@
+/*
+*  You may use this code as you wish, provided you give credit where it's due.
+*
+*  This is a native Linux build of the BrickPi FW, for running the real FW with the drivers without a BrickPi.
+*
+*  The FW (setup() and loop() from BrickPiFW_Compressed_Communication, and the BrickPiUART, BrickPiM, BrickPiA, BrickPiCS,
+*  BrickPiI2C and BrickPiUS libraries) is compiled unchanged against the shims in Arduino.h and EEPROM.h. Each BrickPi uC
+*  runs in its own process, and they share a pseudo-terminal the same way the uCs share the UART.
+*
+*  The shim emulates:
+*    Serial              A socket to the pseudo-terminal, with the same 64 byte receive buffer as the Arduino core.
+*    millis, micros      CLOCK_MONOTONIC since the start. In an ISR, micros is when the ISR was due.
+*    delay...            Real delays, sleeping instead of spinning so that many uCs can share a CPU.
+*    EEPROM              1024 bytes of RAM, with the UART address of each uC already set (1, 2, ...).
+*    PORTx, DDRx, PINC   Plain registers. PINC reads the lines that aren't driven low as high (pullups).
+*    ADC                 Conversions read the value from ShimAnalog. They finish as soon as they start, unless ADIE is set,
+*                        when they take 26 uS (13 ADC clocks at 16 MHz / 32) and then ADC_vect is called.
+*    Motors, encoders    analogWrite and PORTB drive a motor model, which toggles the encoder lines in PIND and calls the
+*                        PCINT2_vect ISR for each change, just like the HW.
+*    Timer 0             If OCIE0A is set in TIMSK0, TIMER0_COMPA_vect is called every 1024 uS.
+*  Interrupts only "happen" when the FW calls millis, micros, delay... or Serial, and not while they're disabled (SREG bit 7, cli).
+*  ISRs run with interrupts disabled, like the HW.
+*  The bytes aren't timed at the baud rate; everything runs at full speed.
+*
+*  To use it, start it, and then run the program with BRICKPI_UART set to the pseudo-terminal:
+*    ./BrickPiNative -l /tmp/BrickPi &
+*    BRICKPI_UART=/tmp/BrickPi ./program
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <poll.h>
+#include <signal.h>
+#include <math.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "BrickPiUART.h"
+#include "BrickPiM.h"
+
+// g++ -O2 -o BrickPiNative -I. -I../BrickPiUART -I../BrickPiM -I../BrickPiA -I../BrickPiCS -I../BrickPiI2C -I../BrickPiUS BrickPiNative.cpp ../BrickPiUART/BrickPiUART.cpp ../BrickPiM/BrickPiM.cpp ../BrickPiA/BrickPiA.cpp ../BrickPiCS/BrickPiCS.cpp ../BrickPiI2C/BrickPiI2C.cpp ../BrickPiUS/BrickPiUS.cpp -x c++ ../BrickPiFW_Compressed_Communication/BrickPiFW_Compressed_Communication.ino
+// ./BrickPiNative [-l link] [-n uCs] [-t] [-v]
+//   -l  Also make a symlink to the pseudo-terminal, so that BRICKPI_UART doesn't change from one run to the next.
+//   -n  How many BrickPi uCs to run (default 2). They use addresses 1, 2, ...
+//   -t  The touch sensor on PORT_1 of every uC is pressed (required for MSG_TYPE_CHANGE_ADDR).
+//   -v  Print the bytes each uC receives and sends.
+
+void setup(void);
+void loop(void);
+
+#define SHIM_MAX_UCS     8
+
+#define MOTOR_MAX_SPEED  2000.0       // Encoder ticks per second at full power
+#define MOTOR_TAU_DRIVE  0.05         // Time constant of the motor speed, in seconds, when driven
+#define MOTOR_TAU_FLOAT  0.3          //   ''                                            when floating
+
+/*
+  Registers
+*/
+
+void ShimADCWritten(void);
+
+ShimReg DDRB, PORTB, DDRC, PORTC, DDRD, PORTD, PIND;
+ShimReg ADCSRA = {0, ShimADCWritten};
+ShimReg ADMUX, ADCL, ADCH;
+ShimReg PCMSK2, PCICR;
+ShimReg SREG = {0x80, NULL};                  // Interrupts are enabled
+ShimReg OCR0A, TIMSK0;
+
+uint16_t ShimAnalog[8] = {1023, 1023, 1023, 1023, 1023, 1023, 1023, 1023};   // The voltage on each ADC channel. Nothing connected reads 1023.
+
+uint8_t ShimPINC(){
+  return (uint8_t)(~DDRC.Value | PORTC.Value);
+}
+
+unsigned long long ShimADCTime;               // When the conversion started with ADIE set finishes, or 0
+unsigned long long ShimIsrUs;                 // While an ISR is running, when it happened. micros returns this, instead of the time now.
+
+#define SHIM_ADC_US      26
+
+unsigned long long ShimNowUs(void);
+
+// Finish the conversion
+void ShimADCDone(){
+  uint16_t value = ShimAnalog[(ADMUX.Value & 0x07)];
+  ADCL.Value = (value & 0xFF);
+  ADCH.Value = (value >> 8);
+  ADCSRA.Value &= ~(1 << ADSC);
+  ADCSRA.Value |= (1 << ADIF);
+  ShimADCTime = 0;
+}
+
+// Writing 1 to ADIF clears it, like the HW (so does a read-modify-write that sees it set). Starting a conversion with ADIE set
+// times it, and otherwise it finishes immediately, and so does one that was being timed when ADIE was cleared.
+void ShimADCWritten(){
+  if(ADCSRA.Value & (1 << ADIF))
+    ADCSRA.Value &= ~(1 << ADIF);
+  if(!(ADCSRA.Value & (1 << ADEN)) || !(ADCSRA.Value & (1 << ADSC)))
+    return;
+  if(ADCSRA.Value & (1 << ADIE)){
+    if(ShimADCTime == 0)
+      ShimADCTime = ((ShimIsrUs ? ShimIsrUs : ShimNowUs()) + SHIM_ADC_US);
+  }
+  else{
+    ShimADCDone();
+  }
+}
+
+void cli(){
+  SREG.Value &= 0x7F;
+}
+
+void sei(){
+  SREG.Value |= 0x80;
+}
+
+/*
+  Motors and encoders
+*/
+
+uint8_t  ShimPWM[2];                          // The last analogWrite to pins 10 and 11
+double   ShimSpeed[2];                        // Encoder ticks per second
+double   ShimPosition[2];
+long     ShimTicks[2];                        // How many encoder line changes have been made
+unsigned long long ShimMotorTime;
+unsigned long long ShimTimerTime;             // When TIMER0_COMPA_vect is next due
+
+#define SHIM_TIMER0_US   1024                 // 16 MHz / 64 / 256
+
+unsigned long long ShimNowUs(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((unsigned long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+void analogWrite(uint8_t pin, int value){
+  if(pin == 10)ShimPWM[PORT_A] = value;
+  if(pin == 11)ShimPWM[PORT_B] = value;
+}
+
+// The power that M_PWM is driving "port" with, from -255 to 255, or 0 with "Float" set if the motor is disabled
+int ShimMotorPower(uint8_t port, bool & Float){
+#if BrickPiVersion   == 1
+  uint8_t Enable = (port ? 0x02 : 0x01);
+  uint8_t Dir    = (port ? 0x20 : 0x10);
+#elif BrickPiVersion == 2
+  uint8_t Enable = (port ? 0x20 : 0x10);
+  uint8_t Dir    = (port ? 0x02 : 0x01);
+#endif
+  Float = !(PORTB.Value & Enable);
+  if(Float)
+    return 0;
+  if(PORTB.Value & Dir)                       // Reverse. The PWM is inverted, so it's driving while the PWM pin is low.
+    return -(255 - ShimPWM[port]);
+  return ShimPWM[port];
+}
+
+// Set the encoder lines of "port" to step "Ticks", the same order the FW counts as forward
+void ShimEncoderLines(uint8_t port, long Ticks){
+  static const uint8_t Phase[4] = {0x00, 0x02, 0x03, 0x01};   // (line 1 << 1) | line 0
+  uint8_t Lines = Phase[(Ticks & 0x03)];
+  uint8_t Mask = (0x14 << port);              // PD2/PD4 for PORT_A, PD3/PD5 for PORT_B
+  uint8_t Value = 0;
+  if(Lines & 0x02)Value |= (0x04 << port);
+  if(Lines & 0x01)Value |= (0x10 << port);
+  PIND.Value = ((PIND.Value & ~Mask) | Value);
+}
+
+// Run the motors up to now, and call the encoder ISR for each encoder line change. While interrupts are disabled, this waits, and the
+// ISRs are called late, like they would be on the HW.
+void ShimMotors(){
+  if(!(SREG.Value & 0x80))
+    return;
+  unsigned long long Now = ShimNowUs();
+  if(ShimMotorTime == 0)
+    ShimMotorTime = Now;
+  while(ShimMotorTime < Now){
+    unsigned long long Until = Now;
+    bool Timer = (TIMSK0.Value & 0x02);                   // OCIE0A
+    if(Timer){
+      if(ShimTimerTime <= ShimMotorTime)
+        ShimTimerTime = (ShimMotorTime + SHIM_TIMER0_US);
+      if(ShimTimerTime < Until)
+        Until = ShimTimerTime;
+    }
+    if(ShimADCTime && ShimADCTime < ShimMotorTime)        // Started before the motors were last run
+      ShimADCTime = ShimMotorTime;
+    if(ShimADCTime && ShimADCTime < Until)
+      Until = ShimADCTime;
+    unsigned long long StepStart = ShimMotorTime;
+    double dt = ((Until - ShimMotorTime) / 1000000.0);
+    ShimMotorTime = Until;
+
+    for(uint8_t port = 0; port < 2; port++){
+      bool Float;
+      int Power = ShimMotorPower(port, Float);
+      double Target = ((Power * MOTOR_MAX_SPEED) / 255);
+      double Tau = (Float ? MOTOR_TAU_FLOAT : MOTOR_TAU_DRIVE);
+      double Decay = exp(-dt / Tau);
+      double Start = ShimPosition[port];
+      ShimPosition[port] += ((Target * dt) + ((ShimSpeed[port] - Target) * Tau * (1 - Decay)));
+      ShimSpeed[port] = (Target + ((ShimSpeed[port] - Target) * Decay));
+
+      long Ticks = (long)floor(ShimPosition[port]);
+      while(ShimTicks[port] != Ticks){
+        double Cross = ((Ticks > ShimTicks[port]) ? (ShimTicks[port] + 1) : ShimTicks[port]);   // Where the line changes
+        ShimTicks[port] += ((Ticks > ShimTicks[port]) ? 1 : -1);
+        ShimEncoderLines(port, ShimTicks[port]);
+        if((PCICR.Value & 0x04) && (PCMSK2.Value & (0x14 << port))){
+          double Fraction = ((Cross - Start) / (ShimPosition[port] - Start));                   // Close enough to linear within a step
+          ShimIsrUs = (StepStart + (unsigned long long)(constrain(Fraction, 0.0, 1.0) * (Until - StepStart)));
+          cli();
+          PCINT2_vect();
+          sei();
+          ShimIsrUs = 0;
+        }
+      }
+    }
+
+    if(Timer && ShimMotorTime == ShimTimerTime){
+      ShimTimerTime += SHIM_TIMER0_US;
+      ShimIsrUs = ShimMotorTime;
+      cli();
+      TIMER0_COMPA_vect();
+      sei();
+      ShimIsrUs = 0;
+    }
+
+    if(ShimADCTime && ShimMotorTime == ShimADCTime){
+      ShimADCDone();
+      if(ADCSRA.Value & (1 << ADIE)){
+        ADCSRA.Value &= ~(1 << ADIF);                     // Cleared when the ISR starts
+        ShimIsrUs = ShimMotorTime;
+        cli();
+        ADC_vect();
+        sei();
+        ShimIsrUs = 0;
+      }
+    }
+  }
+}
+
+/*
+  Time
+*/
+
+unsigned long long ShimStartUs;
+
+unsigned long micros(){
+  if(ShimIsrUs)
+    return (unsigned long)(ShimIsrUs - ShimStartUs);
+  ShimMotors();
+  return (unsigned long)(ShimNowUs() - ShimStartUs);
+}
+
+unsigned long millis(){
+  return (micros() / 1000);
+}
+
+// Sleep, instead of spinning like the Arduino core, so that the other uCs and the host can run on the same CPU
+void delayMicroseconds(unsigned int us){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  t.tv_nsec += ((long)us * 1000);
+  t.tv_sec += (t.tv_nsec / 1000000000);
+  t.tv_nsec %= 1000000000;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+  ShimMotors();
+}
+
+void delay(unsigned long ms){
+  struct timespec t;
+  t.tv_sec = (ms / 1000);
+  t.tv_nsec = ((ms % 1000) * 1000000);
+  nanosleep(&t, NULL);
+  ShimMotors();
+}
+
+/*
+  EEPROM
+*/
+
+EEPROMClass EEPROM;
+uint8_t ShimEEPROM[EEPROM_SIZE];
+
+uint8_t EEPROMClass::read(int address){
+  return ShimEEPROM[(address % EEPROM_SIZE)];
+}
+
+void EEPROMClass::write(int address, uint8_t value){
+  ShimEEPROM[(address % EEPROM_SIZE)] = value;
+}
+
+/*
+  Serial
+*/
+
+HardwareSerial Serial;
+int ShimSerialFd = -1;
+uint8_t ShimAddr;
+bool ShimVerbose = false;
+
+void ShimPrint(const char *what, const uint8_t *data, int bytes){
+  printf("%10lu uC %d %s", (unsigned long)(ShimNowUs() - ShimStartUs), ShimAddr, what);
+  int i = 0;
+  while(i < bytes){
+    printf(" %02X", data[i]);
+    i++;
+  }
+  printf("\n");
+  fflush(stdout);
+}
+uint8_t  ShimRx[SERIAL_BUFFER_SIZE];
+uint16_t ShimRxHead = 0;
+uint16_t ShimRxBytes = 0;
+
+// Move the bytes from the bridge into the receive buffer. If "wait", wait up to 100 uS for them, so that the FW's polling loops don't use a whole CPU.
+// The FW frames messages by BYTE_COUNT, so it doesn't matter if this process didn't get the CPU until after the next message arrived.
+void ShimReceive(bool wait){
+  if(wait){
+    struct pollfd fds;
+    fds.fd = ShimSerialFd;
+    fds.events = POLLIN;
+    fds.revents = 0;
+    struct timespec t = {0, 100000};
+    ppoll(&fds, 1, &t, NULL);
+  }
+  uint8_t Buffer[256];
+  int result;
+  while((result = ::read(ShimSerialFd, Buffer, sizeof(Buffer))) > 0){
+    if(ShimVerbose)
+      ShimPrint("rx", Buffer, result);
+    int i = 0;
+    while(i < result){
+      if(ShimRxBytes < SERIAL_BUFFER_SIZE){   // Otherwise it's lost, like an overrun
+        ShimRx[((ShimRxHead + ShimRxBytes) % SERIAL_BUFFER_SIZE)] = Buffer[i];
+        ShimRxBytes++;
+      }
+      i++;
+    }
+  }
+  if(result == 0)                             // The bridge is gone
+    exit(0);
+}
+
+void HardwareSerial::begin(unsigned long baud){
+  (void)baud;                                 // The pseudo-terminal doesn't have a baud rate
+}
+
+int HardwareSerial::available(){
+  ShimReceive(ShimRxBytes == 0);
+  ShimMotors();
+  return ShimRxBytes;
+}
+
+int HardwareSerial::read(){
+  if(ShimRxBytes == 0)
+    return -1;
+  uint8_t data = ShimRx[ShimRxHead];
+  ShimRxHead = ((ShimRxHead + 1) % SERIAL_BUFFER_SIZE);
+  ShimRxBytes--;
+  return data;
+}
+
+size_t HardwareSerial::write(uint8_t data){
+  return write(&data, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size){
+  if(ShimVerbose)
+    ShimPrint("tx", buffer, size);
+  size_t sent = 0;
+  while(sent < size){
+    int result = ::write(ShimSerialFd, &buffer[sent], (size - sent));
+    if(result <= 0)
+      exit(0);
+    sent += result;
+  }
+  return size;
+}
+
+/*
+  uCs and the bridge to the pseudo-terminal
+*/
+
+// Run one BrickPi uC, talking to the bridge on "fd"
+void ShimRunUC(int fd, uint8_t Addr, bool Touch){
+  ShimSerialFd = fd;
+  ShimAddr = Addr;
+  fcntl(fd, F_SETFL, O_RDWR | O_NONBLOCK);
+  memset(ShimEEPROM, 0xFF, sizeof(ShimEEPROM));
+  ShimEEPROM[EEPROM_SETTING_ADDRESS_UART_MY_ADDRESS] = Addr;
+  if(Touch)
+    ShimAnalog[6] = 100;                      // PORT_1
+  prctl(PR_SET_TIMERSLACK, 1);                // Wake up from delayMicroseconds on time
+  ShimStartUs = ShimNowUs();
+  setup();
+  while(1){
+    loop();
+  }
+}
+
+// Copy the bytes from the host to every uC
+void ShimFromHost(int from, int *to, int count){
+  uint8_t Buffer[256];
+  int result = read(from, Buffer, sizeof(Buffer));
+  if(result <= 0)
+    return;
+  int i = 0;
+  while(i < count){
+    write(to[i], Buffer, result);
+    i++;
+  }
+}
+
+// Copy the bytes from a uC to the host
+void ShimToHost(int from, int to){
+  uint8_t Buffer[256];
+  int result = read(from, Buffer, sizeof(Buffer));
+  int sent = 0;
+  while(sent < result){
+    int written = write(to, &Buffer[sent], (result - sent));
+    if(written <= 0)
+      break;
+    sent += written;
+  }
+}
+
+int main(int argc, char *argv[]){
+  char *Link = NULL;
+  int UCs = 2;
+  bool Touch = false;
+  int opt;
+  while((opt = getopt(argc, argv, "l:n:tv")) != -1){
+    switch(opt){
+      case 'l': Link = optarg;                  break;
+      case 'n': UCs = atoi(optarg);             break;
+      case 't': Touch = true;                   break;
+      case 'v': ShimVerbose = true;             break;
+      default:
+        printf("Usage: %s [-l link] [-n uCs] [-t] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+  if(UCs < 1 || UCs > SHIM_MAX_UCS){
+    printf("Bad arguments\n");
+    return 1;
+  }
+
+  int Master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(Master == -1 || grantpt(Master) || unlockpt(Master)){
+    printf("Unable to open a pseudo-terminal\n");
+    return 1;
+  }
+  struct termios options;
+  tcgetattr(Master, &options);
+  cfmakeraw(&options);
+  tcsetattr(Master, TCSANOW, &options);
+
+  if(Link){
+    unlink(Link);
+    if(symlink(ptsname(Master), Link)){
+      printf("Unable to make the link %s\n", Link);
+      return 1;
+    }
+  }
+
+  int Slave = open(ptsname(Master), O_RDWR | O_NOCTTY);    // Keep the slave open, so that the master doesn't see a hang-up between programs
+
+  signal(SIGPIPE, SIG_IGN);
+
+  int UC[SHIM_MAX_UCS];
+  int i = 0;
+  while(i < UCs){
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)){
+      printf("Unable to make a socket pair\n");
+      return 1;
+    }
+    if(fork() == 0){
+      close(Master);
+      close(Slave);
+      close(sv[0]);
+      int ii = 0;
+      while(ii < i){
+        close(UC[ii]);
+        ii++;
+      }
+      ShimRunUC(sv[1], (i + 1), Touch);
+    }
+    close(sv[1]);
+    UC[i] = sv[0];
+    i++;
+  }
+
+  printf("BrickPi FW (native): %d uCs on %s\n", UCs, (Link ? Link : ptsname(Master)));
+  printf("Run the program with BRICKPI_UART=%s\n", (Link ? Link : ptsname(Master)));
+  fflush(stdout);
+
+  // Every uC receives everything the host sends, and the host receives everything every uC sends
+  struct pollfd fds[SHIM_MAX_UCS + 1];
+  while(1){
+    fds[0].fd = Master;
+    fds[0].events = POLLIN;
+    i = 0;
+    while(i < UCs){
+      fds[i + 1].fd = UC[i];
+      fds[i + 1].events = POLLIN;
+      i++;
+    }
+    if(poll(fds, (UCs + 1), -1) == -1)
+      continue;
+    if(fds[0].revents & POLLIN)
+      ShimFromHost(Master, UC, UCs);
+    i = 0;
+    while(i < UCs){
+      if(fds[i + 1].revents & (POLLIN | POLLHUP)){
+        if(fds[i + 1].revents & POLLHUP && !(fds[i + 1].revents & POLLIN)){
+          printf("uC %d stopped\n", (i + 1));
+          return 1;
+        }
+        ShimToHost(UC[i], Master);
+      }
+      i++;
+    }
+  }
+
+  close(Slave);
+  return 0;
+}
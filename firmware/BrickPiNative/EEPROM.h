@@ -0,0 +1,22 @@
+/*
+*  You may use this code as you wish, provided you give credit where it's due.
+*
+*  This is a shim of the Arduino EEPROM library, for the native build of the BrickPi FW. See BrickPiNative.cpp.
+*/
+
+#ifndef __EEPROM_h_
+#define __EEPROM_h_
+
+#include "Arduino.h"
+
+#define EEPROM_SIZE 1024                      // The same as the ATmega328
+
+class EEPROMClass{
+  public:
+    uint8_t read(int address);
+    void    write(int address, uint8_t value);
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
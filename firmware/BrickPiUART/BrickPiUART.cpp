@@ -29,13 +29,18 @@ Sending byte array looks like this:
     1      BYTE_COUNT   The count of bytes in the message body, excluding the header.
     2-n                 The data  
 
+Messages are framed by BYTE_COUNT. UART_ReadFrame copies bytes out of the Serial receive buffer (which the Serial RX interrupt fills)
+as they arrive, and returns the message as soon as the last byte is in, without waiting to see if the line goes quiet. The line going
+quiet (2 byte times without a new byte) is only used to drop a partial message, and to find the start of the next message after one
+that couldn't be framed.
+
 Returned values
 
 -6 wrong message length
 -5 wrong checksum
 -4 not even the entire header was received
 -3 not my address
--2 timeout           
+-2 timeout (UART_ReadFrame: no complete message yet)
 -1 something went wrong
 0  Destination address was BROADCAST
 1  Destination address was mine
@@ -64,9 +69,40 @@ void UART_Set_Addr(uint8_t NewAddr){
 }
 
 
+uint8_t UART_My_Addr(){
+  return UART_MY_ADDR;
+}
+
+// The baud rate stored by UART_Set_Baud, or UART_BAUD_DEFAULT if there isn't a valid one
+uint32_t UART_Get_Baud(){
+  uint8_t Check = 0xFF;
+  uint32_t Baud = 0;
+  for(int8_t i = 2; i >= 0; i--){
+    uint8_t temp = EEPROM.read(EEPROM_SETTING_ADDRESS_UART_BAUD + i);
+    Check ^= temp;
+    Baud = ((Baud << 8) | temp);
+  }
+  if(Baud == 0 || EEPROM.read(EEPROM_SETTING_ADDRESS_UART_BAUD + 3) != Check)   // Erased (0xFF) fails the check
+    return UART_BAUD_DEFAULT;
+  return Baud;
+}
+
+// Store the baud rate to start with after a reset. Only the bytes that changed are written.
+void UART_Set_Baud(uint32_t NewBaud){
+  uint8_t Stored[4] = {(uint8_t)NewBaud, (uint8_t)(NewBaud >> 8), (uint8_t)(NewBaud >> 16), 0xFF};
+  Stored[3] ^= (Stored[0] ^ Stored[1] ^ Stored[2]);
+  for(uint8_t i = 0; i < 4; i++){
+    if(EEPROM.read(EEPROM_SETTING_ADDRESS_UART_BAUD + i) != Stored[i]){
+      EEPROM.write(EEPROM_SETTING_ADDRESS_UART_BAUD + i, Stored[i]);
+    }
+  }
+}
+
 bool UART_Setup(uint32_t speed){
   UART_BAUD_RATE = speed;
   Serial.begin(UART_BAUD_RATE);  
+  UART_RX_BYTES = 0;
+  UART_RX_SKIP = false;
   return UART_Get_Addr();
 }
 
@@ -91,28 +127,58 @@ void UART_WriteArray(byte ByteCount, byte * OutArray){
   Serial.write(UART_FULL_ARRAY, (byte)(ByteCount + 2));
 }
 
+// Wait up to "timeout" mS (0 waits forever) for a message
 int8_t UART_ReadArray(byte & ByteCount, byte * InArray, int timeout){          // timeout in mS, not uS
-
   long OrigionalTick = millis();
-  while(!(Serial.available())){                                                // Wait until data has been received
+  while(true){
+    int8_t Result = UART_ReadFrame(ByteCount, InArray);
+    if(Result != -2)return Result;
     if(timeout && (millis() - OrigionalTick >= timeout))return -2;             // return -2 if it timed-out waiting for the responce.
   }
+}
+
+// Take whatever has been received since the last call, and return the message if it's complete. Doesn't wait.
+int8_t UART_ReadFrame(byte & ByteCount, byte * InArray){
+  uint32_t Now = micros();
+  byte Available = Serial.available();
   
-  byte DataAvailable = 0;
-  while(DataAvailable < Serial.available()){                                   // If it's been <<<2 times a single byte time>>> since the last data was received, assume it's the end of the message.
-    DataAvailable = Serial.available();
-    uint32_t delayMicrosecondsTime = (((1000000 * 10) / UART_BAUD_RATE) * 2);
-    delayMicroseconds(delayMicrosecondsTime);
+  if(!Available){
+    if((UART_RX_BYTES || UART_RX_SKIP) && ((Now - UART_RX_TIME) > (((1000000 * 10) / UART_BAUD_RATE) * 2))){   // The line went quiet
+      byte Partial = UART_RX_BYTES;
+      bool Skipped = UART_RX_SKIP;
+      UART_RX_BYTES = 0;
+      UART_RX_SKIP = false;
+      if(!Skipped){
+        return ((Partial < 3) ? -4 : -6);                                      // Part of a message, and the rest never came
+      }
+    }
+    return -2;
   }
+  UART_RX_TIME = Now;
   
-  if(DataAvailable < 3){                                                       // Not even the entire header was received.
+  if(UART_RX_SKIP){
     UART_Flush();
-    return -4;
+    return -2;
   }
-
-  for(byte i = 0; i < DataAvailable; i++){
-    UART_FULL_ARRAY[i] = Serial.read();
+  
+  byte Needed = ((UART_RX_BYTES < 3) ? 3 : (UART_FULL_ARRAY[2] + 3));
+  while(Available && UART_RX_BYTES < Needed){                                  // Only this message. The next one stays in the Serial buffer.
+    UART_FULL_ARRAY[UART_RX_BYTES] = Serial.read();
+    UART_RX_BYTES++;
+    Available--;
+    if(UART_RX_BYTES == 3){
+      if((UART_FULL_ARRAY[2] + 3) > UART_FULL_ARRAY_BYTES){                  // Too long to be a message
+        UART_RX_BYTES = 0;
+        UART_RX_SKIP = true;
+        return -6;
+      }
+      Needed = (UART_FULL_ARRAY[2] + 3);
+    }
+  }
+  if(UART_RX_BYTES < Needed){
+    return -2;
   }
+  UART_RX_BYTES = 0;
   
   uint8_t DestAddr = UART_FULL_ARRAY[0];
   uint8_t Checksum = UART_FULL_ARRAY[1];
@@ -121,22 +187,15 @@ int8_t UART_ReadArray(byte & ByteCount, byte * InArray, int timeout){          /
   if (DestAddr == UART_MY_ADDR || DestAddr == 0)
   {
 
-    if(ByteCount != (DataAvailable - 3)){
-      return -6;
-    }
-
     UART_CKSM = DestAddr;
     UART_CKSM += ByteCount;
-    for(byte i = 3; i < DataAvailable; i ++){
+    for(byte i = 3; i < Needed; i ++){
       UART_CKSM += UART_FULL_ARRAY[i];
     }
     UART_CKSM &= 0xFF;
     
-    if(Checksum != UART_CKSM){
-/*      Serial.print("Checksum received: ");
-      Serial.print(Checksum);
-      Serial.print("   Checksum computed: ");
-      Serial.println(UART_CKSM);*/
+    if(Checksum != UART_CKSM){                                                 // BYTE_COUNT might be wrong too, so find the next message by the gap before it
+      UART_RX_SKIP = true;
       return -5;
     }
     
@@ -150,4 +209,4 @@ int8_t UART_ReadArray(byte & ByteCount, byte * InArray, int timeout){          /
     return -3;
   }
   return -1;
-}
\ No newline at end of file
+}
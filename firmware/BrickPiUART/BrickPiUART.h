@@ -19,17 +19,28 @@
 #include "EEPROM.h"
 
 #define EEPROM_SETTING_ADDRESS_UART_MY_ADDRESS     0
+#define EEPROM_SETTING_ADDRESS_UART_BAUD         256   // 3 bytes, low byte first, and a check byte. (The FW stores its sensor setup from 1.)
+
+#define UART_BAUD_DEFAULT 9600                         // If a baud rate hasn't been stored
+#define UART_FULL_ARRAY_BYTES 128                      // The longest message, including the 3 header bytes
 
 bool   UART_Setup(uint32_t speed);
 void   UART_WriteArray(byte ByteCount, byte * OutArray);
 int8_t UART_ReadArray(byte & ByteCount, byte * InArray, int timeout = 0);
+int8_t UART_ReadFrame(byte & ByteCount, byte * InArray);
 void   UART_Flush(void);
 bool   UART_Get_Addr(void);
 void   UART_Set_Addr(uint8_t NewAddr);
+uint8_t UART_My_Addr(void);
+uint32_t UART_Get_Baud(void);
+void   UART_Set_Baud(uint32_t NewBaud);
 
 static uint32_t UART_BAUD_RATE = 0;
 static uint8_t  UART_MY_ADDR;
 static uint16_t UART_CKSM;
-static uint8_t  UART_FULL_ARRAY[128];
+static uint8_t  UART_FULL_ARRAY[UART_FULL_ARRAY_BYTES];
+static uint8_t  UART_RX_BYTES;         // How many bytes of the message being received are in UART_FULL_ARRAY
+static uint32_t UART_RX_TIME;          // micros() when a new byte was last seen
+static bool     UART_RX_SKIP;          // Discarding bytes until the line is quiet, because a message couldn't be framed
 
 #endif
\ No newline at end of file